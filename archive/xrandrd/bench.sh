@@ -0,0 +1,66 @@
+#!/bin/sh
+#
+# Replay hotplug scripts through xrandrd's simulated X server and
+# summarize how it reacted.  See usage below, or run "make bench
+# BENCH_ARGS='...'".
+#
+# This needs no X server at all.  Xvfb's RandR has a single output
+# that can't be unplugged, so it can't stand in for hotplug.
+
+usage() {
+    echo "usage: $0 [-n runs] [-q ms] [replay...]
+
+Run each replay script (default replay/*.replay) <runs> times through
+xrandrd -q <ms> and report per script how many events xrandrd saw and merged, how many
+snapshots and reconfigurations it made, and the distribution of time
+from the first event of a change to the screen being configured, in ms." >&2
+    exit 2
+}
+
+set -e
+
+RUNS=1
+QUIET=250
+while getopts "n:q:" opt; do
+    case $opt in
+        n) RUNS=$OPTARG ;;
+        q) QUIET=$OPTARG ;;
+        *) usage ;;
+    esac
+done
+shift $(expr $OPTIND - 1)
+
+HERE=$(cd $(dirname $0) && pwd)
+REPLAYS="$@"
+if [ -z "$REPLAYS" ]; then
+    REPLAYS=$(ls $HERE/replay/*.replay)
+fi
+
+TMP=$(mktemp -d)
+trap 'rm -rf $TMP' EXIT
+trap 'exit 1' INT TERM
+
+printf "%-12s %7s %7s %6s %6s %8s %6s %9s %9s %9s %9s\n" \
+    replay events merged snaps probes reconfig abandn lat_p50 lat_p90 \
+    lat_p99 lat_max
+for replay in $REPLAYS; do
+    for i in $(seq $RUNS); do
+        $HERE/xrandrd -S $replay -p '' -q $QUIET >$TMP/log
+        grep ^xrandrd-stats $TMP/log
+    done | awk -v name=$(basename $replay .replay) '
+    {
+        for (i = 2; i <= NF; i++) {
+            split($i, kv, "=")
+            sum[kv[1]] += kv[2]
+        }
+        n++
+    }
+    END {
+        # Counts are totals over all runs; latencies are means
+        printf "%-12s %7d %7d %6d %6d %8d %6d %9.1f %9.1f %9.1f %9.1f\n",
+            name, sum["events"], sum["merged"], sum["snapshots"],
+            sum["probes"], sum["reconfigs"], sum["abandoned"],
+            sum["lat_p50"] / n, sum["lat_p90"] / n, sum["lat_p99"] / n,
+            sum["lat_max"] / n
+    }'
+done
@@ -0,0 +1,585 @@
+// A simulated X server that replays a script of hotplug events, so
+// xrandrd's reaction to a dock or a flaky cable can be measured
+// without plugging anything in.  Each line of the script is a step:
+//
+//   crtcs <n>                      give the screen n more CRTCs
+//   mode <name> <width> <height> <dot clock in kHz>
+//   output <name>                  add a disconnected output
+//   connect <output> <edid> <mode>...
+//                                  plug a monitor into output; edid is
+//                                  any word that identifies it, and
+//                                  the first mode is preferred
+//   disconnect <output>
+//   rotate <output> <rotation>     rotate the output by hand, as with
+//                                  xrandr --rotate
+//   mirror <output> <other>        drive output from other's CRTC by
+//                                  hand, so it shows the same thing
+//   event <kind> [<count>]         send events that change nothing;
+//                                  kind is output, edid, property,
+//                                  crtc or screen
+//   cost <probe|current|apply> <ms>
+//                                  make later probed or current
+//                                  snapshots or layouts take this long
+//   wait <ms>                      run later steps this much later
+//   repeat <n>                     run the steps up to the matching
+//   end                            end n times
+//
+// Steps before the first wait are the initial state, which is in
+// place before the daemon takes its first snapshot.  Blank lines and
+// lines starting with # are ignored.  Every output can use every
+// CRTC, and every CRTC can rotate and reflect.
+//
+// Steps run on the real clock, so latencies include the time xrandrd
+// spends waiting for bursts to quiet down, just as with a real server.
+
+#define _GNU_SOURCE /* getline */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include "xrandrd.h"
+
+struct step
+{
+        // When to run, in nanoseconds after simOpen
+        uint64_t at;
+        // Script line, for errors
+        int line;
+        int nargs;
+        char **args;
+};
+
+static const char *path;
+static struct step *steps;
+static int nsteps, nextStep;
+static uint64_t startNs;
+static int timerFd;
+
+// The server's state.  Outputs' possible CRTCs and CRTCs' possible
+// outputs are filled in by copies.
+static struct randrResources state;
+static unsigned int screenWidth, screenHeight;
+
+// Events sent but not yet drained, by what they call for
+static int queued[CHANGE_PROBE + 1];
+
+// Simulated server latency, in milliseconds
+static int probeCostMs, currentCostMs, applyCostMs;
+
+static void
+scriptError(int line, const char *msg, const char *arg)
+{
+        fprintf(stderr, "%s:%d: %s%s%s\n", path, line, msg,
+                arg ? " " : "", arg ? arg : "");
+        exit(1);
+}
+
+static void
+sleepMs(int ms)
+{
+        struct timespec ts = {ms / 1000, (ms % 1000) * 1000000l};
+        while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+                ;
+}
+
+static void *
+grow(void *array, int n, size_t size)
+{
+        // Grow by doubling, so only reallocate at powers of two
+        if (n & (n - 1))
+                return array;
+        array = realloc(array, (n ? 2 * n : 1) * size);
+        if (!array) {
+                fprintf(stderr, "Out of memory\n");
+                exit(1);
+        }
+        return array;
+}
+
+// How many arguments each step takes, or -1 for at least min
+static const struct
+{
+        const char *name;
+        int min, max;
+} stepArgs[] = {
+        {"crtcs", 1, 1}, {"mode", 4, 4}, {"output", 1, 1},
+        {"connect", 3, -1}, {"disconnect", 1, 1}, {"rotate", 2, 2},
+        {"mirror", 2, 2}, {"event", 1, 2},
+        {"cost", 2, 2}, {"wait", 1, 1}, {"repeat", 1, 1}, {"end", 0, 0},
+};
+
+static void
+loadScript(void)
+{
+        FILE *fp = fopen(path, "r");
+        if (!fp) {
+                perror(path);
+                exit(1);
+        }
+
+        // Start of each open repeat block: index of its first step,
+        // its time and its count
+        struct
+        {
+                int step, line, count;
+                uint64_t at;
+        } blocks[16];
+        int nblocks = 0;
+        uint64_t at = 0;
+        char *buf = NULL;
+        size_t bufSize = 0;
+        for (int line = 1; getline(&buf, &bufSize, fp) >= 0; ++line) {
+                char **args = NULL;
+                int nargs = 0;
+                for (char *tok = strtok(buf, " \t\n"); tok;
+                     tok = strtok(NULL, " \t\n")) {
+                        if (nargs == 0 && tok[0] == '#')
+                                break;
+                        args = grow(args, nargs, sizeof *args);
+                        args[nargs++] = copyName(tok, strlen(tok));
+                }
+                if (nargs == 0)
+                        continue;
+
+                int i;
+                for (i = 0; i < sizeof stepArgs / sizeof *stepArgs; ++i)
+                        if (strcmp(args[0], stepArgs[i].name) == 0)
+                                break;
+                if (i == sizeof stepArgs / sizeof *stepArgs)
+                        scriptError(line, "unknown step", args[0]);
+                if (nargs - 1 < stepArgs[i].min ||
+                    (stepArgs[i].max >= 0 && nargs - 1 > stepArgs[i].max))
+                        scriptError(line, "wrong number of arguments to",
+                                    args[0]);
+
+                if (strcmp(args[0], "wait") == 0) {
+                        at += atoi(args[1]) * 1000000ull;
+                } else if (strcmp(args[0], "repeat") == 0) {
+                        if (nblocks == sizeof blocks / sizeof *blocks)
+                                scriptError(line, "repeats nested too deep",
+                                            NULL);
+                        blocks[nblocks].step = nsteps;
+                        blocks[nblocks].line = line;
+                        blocks[nblocks].count = atoi(args[1]);
+                        blocks[nblocks++].at = at;
+                } else if (strcmp(args[0], "end") == 0) {
+                        if (nblocks == 0)
+                                scriptError(line, "end without repeat", NULL);
+                        // Append copies of the block, each shifted by
+                        // the block's length.  The copies share
+                        // arguments with the original.
+                        nblocks--;
+                        int first = blocks[nblocks].step, last = nsteps;
+                        uint64_t len = at - blocks[nblocks].at;
+                        for (int k = 1; k < blocks[nblocks].count; ++k) {
+                                for (int j = first; j < last; ++j) {
+                                        steps = grow(steps, nsteps,
+                                                     sizeof *steps);
+                                        steps[nsteps] = steps[j];
+                                        steps[nsteps++].at += k * len;
+                                }
+                        }
+                        if (blocks[nblocks].count > 1)
+                                at += (blocks[nblocks].count - 1) * len;
+                } else {
+                        steps = grow(steps, nsteps, sizeof *steps);
+                        steps[nsteps++] = (struct step){at, line, nargs, args};
+                        continue;
+                }
+                for (i = 0; i < nargs; ++i)
+                        free(args[i]);
+                free(args);
+        }
+        if (nblocks)
+                scriptError(blocks[nblocks - 1].line, "repeat without end",
+                            NULL);
+        free(buf);
+        fclose(fp);
+}
+
+static struct randrOutput *
+simOutput(struct step *st, const char *name)
+{
+        for (int i = 0; i < state.noutput; ++i)
+                if (strcmp(state.outputs[i].name, name) == 0)
+                        return &state.outputs[i];
+        scriptError(st->line, "no such output", name);
+        return NULL;
+}
+
+static struct randrMode *
+simMode(struct step *st, const char *name)
+{
+        for (int i = 0; i < state.nmode; ++i)
+                if (strcmp(state.modes[i].name, name) == 0)
+                        return &state.modes[i];
+        scriptError(st->line, "no such mode", name);
+        return NULL;
+}
+
+static void
+sendEvents(struct step *st, const char *kind, int count)
+{
+        static const struct
+        {
+                const char *name;
+                enum change change;
+        } kinds[] = {
+                {"output", CHANGE_TOPOLOGY}, {"edid", CHANGE_TOPOLOGY},
+                {"property", CHANGE_NONE}, {"crtc", CHANGE_LAYOUT},
+                {"screen", CHANGE_NONE},
+        };
+        for (int i = 0; i < sizeof kinds / sizeof *kinds; ++i) {
+                if (strcmp(kinds[i].name, kind) == 0) {
+                        queued[kinds[i].change] += count;
+                        return;
+                }
+        }
+        scriptError(st->line, "unknown event kind", kind);
+}
+
+static bool
+crtcDrives(struct randrCrtc *c, uint32_t output)
+{
+        for (int i = 0; i < c->noutput; ++i)
+                if (c->outputs[i] == output)
+                        return true;
+        return false;
+}
+
+static void
+runStep(struct step *st)
+{
+        const char *cmd = st->args[0];
+        char **args = st->args + 1;
+        state.timestamp++;
+
+        if (strcmp(cmd, "crtcs") == 0) {
+                for (int n = atoi(args[0]); n > 0; --n) {
+                        state.crtcs = grow(state.crtcs, state.ncrtc,
+                                           sizeof *state.crtcs);
+                        state.crtcs[state.ncrtc] = (struct randrCrtc){
+                                .id = 0x300 + state.ncrtc,
+                                .rotation = RR_Rotate_0,
+                                .rotations = RR_Rotate_0 | RR_Rotate_90 |
+                                        RR_Rotate_180 | RR_Rotate_270 |
+                                        RR_Reflect_X | RR_Reflect_Y,
+                                .outputs = xmalloc(sizeof(uint32_t)),
+                        };
+                        state.ncrtc++;
+                }
+                state.configTimestamp = state.timestamp;
+        } else if (strcmp(cmd, "mode") == 0) {
+                state.modes = grow(state.modes, state.nmode,
+                                   sizeof *state.modes);
+                unsigned int w = atoi(args[1]), h = atoi(args[2]);
+                // Pretend to CVT reduced blanking
+                state.modes[state.nmode] = (struct randrMode){
+                        0x100 + state.nmode, w, h, atol(args[3]) * 1000,
+                        w + 160, h + 23, 0, copyName(args[0], strlen(args[0]))};
+                state.nmode++;
+        } else if (strcmp(cmd, "output") == 0) {
+                state.outputs = grow(state.outputs, state.noutput,
+                                     sizeof *state.outputs);
+                state.outputs[state.noutput] = (struct randrOutput){
+                        .id = 0x200 + state.noutput,
+                        .name = copyName(args[0], strlen(args[0])),
+                        .connection = RR_Disconnected,
+                };
+                state.noutput++;
+                state.configTimestamp = state.timestamp;
+        } else if (strcmp(cmd, "connect") == 0) {
+                struct randrOutput *o = simOutput(st, args[0]);
+                free(o->modes);
+                free(o->edid);
+                o->connection = RR_Connected;
+                o->nmode = st->nargs - 3;
+                o->npreferred = 1;
+                o->modes = xmalloc(o->nmode * sizeof *o->modes);
+                for (int i = 0; i < o->nmode; ++i)
+                        o->modes[i] = simMode(st, args[2 + i])->id;
+                // A fixed EDID header, then the monitor's name
+                static const unsigned char header[] = {
+                        0, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0};
+                o->edidLen = 128;
+                o->edid = xmalloc(o->edidLen);
+                memset(o->edid, 0, o->edidLen);
+                memcpy(o->edid, header, sizeof header);
+                strncpy((char*)o->edid + sizeof header, args[1],
+                        o->edidLen - sizeof header);
+                struct randrMode *m = findMode(&state, o->modes[0]);
+                o->mmWidth = m->width * 254 / 960;
+                o->mmHeight = m->height * 254 / 960;
+                state.configTimestamp = state.timestamp;
+                queued[CHANGE_TOPOLOGY] += 2;
+        } else if (strcmp(cmd, "disconnect") == 0) {
+                struct randrOutput *o = simOutput(st, args[0]);
+                // Like a real server, leave its CRTC alone
+                o->connection = RR_Disconnected;
+                o->nmode = o->npreferred = o->edidLen = 0;
+                o->mmWidth = o->mmHeight = 0;
+                state.configTimestamp = state.timestamp;
+                queued[CHANGE_TOPOLOGY]++;
+        } else if (strcmp(cmd, "rotate") == 0) {
+                struct randrOutput *o = simOutput(st, args[0]);
+                unsigned int rotation;
+                if (!parseRotation(args[1], &rotation))
+                        scriptError(st->line, "unknown rotation", args[1]);
+                for (int i = 0; i < state.ncrtc; ++i) {
+                        struct randrCrtc *c = &state.crtcs[i];
+                        if (!c->mode || !crtcDrives(c, o->id))
+                                continue;
+                        struct randrMode *m = findMode(&state, c->mode);
+                        bool sideways =
+                                rotation & (RR_Rotate_90 | RR_Rotate_270);
+                        c->rotation = rotation;
+                        c->width = sideways ? m->height : m->width;
+                        c->height = sideways ? m->width : m->height;
+                        queued[CHANGE_LAYOUT]++;
+                }
+        } else if (strcmp(cmd, "mirror") == 0) {
+                struct randrOutput *o = simOutput(st, args[0]);
+                struct randrOutput *other = simOutput(st, args[1]);
+                struct randrCrtc *to = NULL;
+                for (int i = 0; i < state.ncrtc; ++i)
+                        if (state.crtcs[i].mode &&
+                            crtcDrives(&state.crtcs[i], other->id))
+                                to = &state.crtcs[i];
+                if (!to)
+                        scriptError(st->line, "output is off", args[1]);
+                // Take output off any other CRTC, turning that off if
+                // it was all it drove
+                for (int i = 0; i < state.ncrtc; ++i) {
+                        struct randrCrtc *c = &state.crtcs[i];
+                        if (c == to || !crtcDrives(c, o->id))
+                                continue;
+                        int n = 0;
+                        for (int j = 0; j < c->noutput; ++j)
+                                if (c->outputs[j] != o->id)
+                                        c->outputs[n++] = c->outputs[j];
+                        c->noutput = n;
+                        if (!n) {
+                                c->x = c->y = c->width = c->height = 0;
+                                c->mode = 0;
+                        }
+                        queued[CHANGE_LAYOUT]++;
+                }
+                if (!crtcDrives(to, o->id)) {
+                        to->outputs = grow(to->outputs, to->noutput,
+                                           sizeof *to->outputs);
+                        to->outputs[to->noutput++] = o->id;
+                        queued[CHANGE_LAYOUT]++;
+                }
+        } else if (strcmp(cmd, "event") == 0) {
+                sendEvents(st, args[0], st->nargs > 2 ? atoi(args[1]) : 1);
+        } else if (strcmp(cmd, "cost") == 0) {
+                int ms = atoi(args[1]);
+                if (strcmp(args[0], "probe") == 0)
+                        probeCostMs = ms;
+                else if (strcmp(args[0], "current") == 0)
+                        currentCostMs = ms;
+                else if (strcmp(args[0], "apply") == 0)
+                        applyCostMs = ms;
+                else
+                        scriptError(st->line, "unknown cost", args[0]);
+        }
+}
+
+// Wake the event loop for the next thing that will happen: right away
+// if events are queued, otherwise at the next step.
+static void
+armTimer(void)
+{
+        struct itimerspec its = {};
+        bool pending = false;
+        for (int i = 0; i <= CHANGE_PROBE; ++i)
+                pending = pending || queued[i];
+        if (pending) {
+                its.it_value.tv_nsec = 1;
+        } else if (nextStep < nsteps) {
+                uint64_t t = startNs + steps[nextStep].at;
+                its.it_value.tv_sec = t / 1000000000;
+                its.it_value.tv_nsec = t % 1000000000;
+        }
+        if (timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+                perror("timerfd_settime");
+                exit(1);
+        }
+}
+
+// Run every step that's come due.
+static void
+runDueSteps(void)
+{
+        uint64_t now = monotonicNs();
+        while (nextStep < nsteps && startNs + steps[nextStep].at <= now)
+                runStep(&steps[nextStep++]);
+}
+
+static int
+simDrain(enum change *change)
+{
+        uint64_t expirations;
+        if (read(timerFd, &expirations, sizeof expirations) < 0 &&
+            errno != EAGAIN) {
+                perror("read");
+                exit(1);
+        }
+        runDueSteps();
+
+        int n = 0;
+        for (int i = 0; i <= CHANGE_PROBE; ++i) {
+                if (queued[i] && i > *change)
+                        *change = i;
+                n += queued[i];
+                queued[i] = 0;
+        }
+        armTimer();
+        return n;
+}
+
+static bool
+simDone(void)
+{
+        if (nextStep < nsteps)
+                return false;
+        for (int i = 0; i <= CHANGE_PROBE; ++i)
+                if (queued[i])
+                        return false;
+        return true;
+}
+
+static struct randrResources *
+simFetch(bool probe)
+{
+        sleepMs(probe ? probeCostMs : currentCostMs);
+
+        struct randrResources *r = xmalloc(sizeof *r);
+        *r = state;
+        r->modes = xmalloc(r->nmode * sizeof *r->modes);
+        for (int i = 0; i < r->nmode; ++i) {
+                r->modes[i] = state.modes[i];
+                r->modes[i].name = copyName(state.modes[i].name,
+                                            strlen(state.modes[i].name));
+        }
+        uint32_t *crtcIds = xmalloc(r->ncrtc * sizeof *crtcIds);
+        for (int i = 0; i < r->ncrtc; ++i)
+                crtcIds[i] = state.crtcs[i].id;
+        uint32_t *outputIds = xmalloc(r->noutput * sizeof *outputIds);
+        r->outputs = xmalloc(r->noutput * sizeof *r->outputs);
+        for (int i = 0; i < r->noutput; ++i) {
+                struct randrOutput *o = &r->outputs[i];
+                *o = state.outputs[i];
+                outputIds[i] = o->id;
+                o->name = copyName(o->name, strlen(o->name));
+                o->ncrtc = r->ncrtc;
+                o->crtcs = copyIds(crtcIds, r->ncrtc);
+                o->modes = copyIds(o->modes, o->nmode);
+                if (o->edidLen) {
+                        o->edid = xmalloc(o->edidLen);
+                        memcpy(o->edid, state.outputs[i].edid, o->edidLen);
+                } else {
+                        o->edid = NULL;
+                }
+                o->crtc = 0;
+                for (int j = 0; j < r->ncrtc; ++j)
+                        if (crtcDrives(&state.crtcs[j], o->id))
+                                o->crtc = state.crtcs[j].id;
+        }
+        r->crtcs = xmalloc(r->ncrtc * sizeof *r->crtcs);
+        for (int i = 0; i < r->ncrtc; ++i) {
+                struct randrCrtc *c = &r->crtcs[i];
+                *c = state.crtcs[i];
+                c->outputs = copyIds(c->outputs, c->noutput);
+                c->npossible = r->noutput;
+                c->possible = copyIds(outputIds, r->noutput);
+        }
+        free(crtcIds);
+        free(outputIds);
+        return r;
+}
+
+// Apply l the way a server would, sending a CRTC event for each CRTC
+// that changes and a screen event if the screen is resized.
+static bool
+simApply(struct randrResources *r, struct layout *l)
+{
+        if (l->n == 0) {
+                printf("Nothing to lay out\n");
+                return false;
+        }
+        // Like a real server, handle any hotplug that happens while
+        // the requests are on their way.  If it changed the
+        // configuration, r is stale and the server refuses them.
+        sleepMs(applyCostMs);
+        runDueSteps();
+        if (r->configTimestamp != state.configTimestamp) {
+                fprintf(stderr, "Failed to apply layout\n");
+                armTimer();
+                return false;
+        }
+        for (int i = 0; i < state.ncrtc; ++i) {
+                struct randrCrtc *c = &state.crtcs[i];
+                struct layoutOutput *lo = layoutCrtc(l, c->id);
+                if (lo && !crtcMatches(c, lo)) {
+                        c->x = lo->x;
+                        c->y = lo->y;
+                        c->width = lo->width;
+                        c->height = lo->height;
+                        c->mode = lo->mode;
+                        c->rotation = lo->rotation;
+                        c->noutput = 1;
+                        c->outputs[0] = lo->output;
+                        queued[CHANGE_LAYOUT]++;
+                } else if (!lo && c->mode) {
+                        c->x = c->y = c->width = c->height = 0;
+                        c->mode = 0;
+                        c->noutput = 0;
+                        queued[CHANGE_LAYOUT]++;
+                }
+        }
+        if (l->width != screenWidth || l->height != screenHeight) {
+                screenWidth = l->width;
+                screenHeight = l->height;
+                queued[CHANGE_NONE]++;
+        }
+        // Like applyLayout, leave the primary alone if l has none.
+        if (l->primary)
+                state.primary = l->primary;
+        armTimer();
+        return true;
+}
+
+struct backend *
+simOpen(const char *scriptPath)
+{
+        static struct backend b = {
+                .name = "simulated",
+                .cheapSnapshots = true,
+                .fetch = simFetch,
+                .apply = simApply,
+                .drain = simDrain,
+                .done = simDone,
+        };
+
+        path = scriptPath;
+        loadScript();
+        timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (timerFd < 0) {
+                perror("timerfd_create");
+                exit(1);
+        }
+        b.fd = timerFd;
+
+        // Set up the initial state quietly
+        while (nextStep < nsteps && steps[nextStep].at == 0)
+                runStep(&steps[nextStep++]);
+        memset(queued, 0, sizeof queued);
+        startNs = monotonicNs();
+        armTimer();
+        return &b;
+}
@@ -0,0 +1,465 @@
+// Runtime statistics, and the status socket that serves them along
+// with the current snapshot.  Everything is answered from memory, so
+// asking never costs a round trip to the X server.
+//
+// "stats" answers with one "<name> <value>" line per counter and one
+// "<name> count=... mean_us=... p50_us=... p90_us=... p99_us=...
+// max_us=..." line per histogram.  "snapshot" answers with a
+// "snapshot" line, then an "output" line per output and a "crtc" line
+// per CRTC, each of key=value fields.  "json" answers with all of it
+// as one JSON object, including the histogram buckets.
+
+#define _GNU_SOURCE /* accept4 */
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "xrandrd.h"
+
+struct stats stats;
+
+uint64_t
+histBound(int i)
+{
+        static const int steps[] = {1, 2, 5};
+        uint64_t bound = steps[i % 3];
+        for (int j = 0; j < i / 3; ++j)
+                bound *= 10;
+        return bound;
+}
+
+void
+histAdd(struct histogram *h, uint64_t ns)
+{
+        int i = 0;
+        while (i < HIST_BUCKETS && ns > histBound(i) * 1000)
+                i++;
+        h->buckets[i]++;
+        h->count++;
+        h->sumNs += ns;
+        if (ns > h->maxNs)
+                h->maxNs = ns;
+}
+
+uint64_t
+histQuantile(struct histogram *h, double p)
+{
+        if (h->count == 0)
+                return 0;
+        unsigned long rank = p * (h->count - 1) + 1, seen = 0;
+        uint64_t maxUs = h->maxNs / 1000;
+        for (int i = 0; i < HIST_BUCKETS; ++i) {
+                seen += h->buckets[i];
+                if (seen >= rank)
+                        return histBound(i) < maxUs ? histBound(i) : maxUs;
+        }
+        return maxUs;
+}
+
+// A response being built up
+struct buf
+{
+        char *data;
+        size_t len, cap;
+};
+
+static void
+bprintf(struct buf *b, const char *fmt, ...)
+{
+        va_list ap;
+        while (1) {
+                va_start(ap, fmt);
+                int n = vsnprintf(b->data + b->len, b->cap - b->len, fmt, ap);
+                va_end(ap);
+                if (n < 0)
+                        return;
+                if (b->len + n < b->cap) {
+                        b->len += n;
+                        return;
+                }
+                b->cap = 2 * (b->len + n + 1);
+                b->data = realloc(b->data, b->cap);
+                if (!b->data) {
+                        fprintf(stderr, "Out of memory\n");
+                        exit(1);
+                }
+        }
+}
+
+// Output names come from the driver.  Escape anything JSON wouldn't
+// take as is.
+static void
+jsonString(struct buf *b, const char *s)
+{
+        bprintf(b, "\"");
+        for (; *s; ++s) {
+                unsigned char c = *s;
+                if (c == '"' || c == '\\')
+                        bprintf(b, "\\%c", c);
+                else if (c < 0x20)
+                        bprintf(b, "\\u%04x", c);
+                else
+                        bprintf(b, "%c", c);
+        }
+        bprintf(b, "\"");
+}
+
+static const struct
+{
+        const char *name;
+        unsigned long *value;
+} counters[] = {
+        {"events", &stats.events},
+        {"backend_events", &stats.backendEvents},
+        {"udev_events", &stats.udevEvents},
+        {"resumes", &stats.resumes},
+        {"bursts", &stats.bursts},
+        {"events_merged", &stats.eventsMerged},
+        {"full_probes", &stats.fullProbes},
+        {"probes_avoided", &stats.probesAvoided},
+        {"topology_changes", &stats.topologyChanges},
+        {"reconfigs_in_budget", &stats.reconfigsInBudget},
+        {"reconfigs_over_budget", &stats.reconfigsOverBudget},
+        {"reconfigs_abandoned", &stats.reconfigsAbandoned},
+        {"profiles_used", &stats.profilesUsed},
+        {"command_runs", &stats.commandRuns},
+        {"command_timeouts", &stats.commandTimeouts},
+        {"command_failures", &stats.commandFailures},
+        {"status_requests", &stats.statusRequests},
+};
+
+static const struct
+{
+        const char *name;
+        struct histogram *h;
+} histograms[] = {
+        {"fetch_probed", &stats.fetchProbed},
+        {"fetch_current", &stats.fetchCurrent},
+        {"apply", &stats.apply},
+        {"command", &stats.command},
+        {"configured", &stats.configured},
+};
+
+#define NELEM(a) (sizeof (a) / sizeof *(a))
+
+static const char *
+connectionName(int connection)
+{
+        switch (connection) {
+        case RR_Connected:
+                return "connected";
+        case RR_Disconnected:
+                return "disconnected";
+        default:
+                return "unknown";
+        }
+}
+
+// Describe the monitor on o by its EDID's manufacturer and product
+// code, say "DEL:a0f3".  Return false if it has no EDID.
+static bool
+edidId(struct randrOutput *o, char out[16])
+{
+        if (o->edidLen < 128)
+                return false;
+        unsigned int mfg = o->edid[8] << 8 | o->edid[9];
+        unsigned int product = o->edid[10] | o->edid[11] << 8;
+        char letters[4];
+        for (int i = 0; i < 3; ++i) {
+                letters[i] = '@' + ((mfg >> (10 - 5 * i)) & 0x1f);
+                if (letters[i] < 'A' || letters[i] > 'Z')
+                        letters[i] = '?';
+        }
+        letters[3] = 0;
+        snprintf(out, 16, "%s:%04x", letters, product);
+        return true;
+}
+
+static void
+textStats(struct buf *b)
+{
+        for (int i = 0; i < NELEM(counters); ++i)
+                bprintf(b, "%s %lu\n", counters[i].name, *counters[i].value);
+        for (int i = 0; i < NELEM(histograms); ++i) {
+                struct histogram *h = histograms[i].h;
+                bprintf(b, "%s count=%lu mean_us=%llu p50_us=%llu "
+                        "p90_us=%llu p99_us=%llu max_us=%llu\n",
+                        histograms[i].name, h->count,
+                        (unsigned long long)(h->count ?
+                                             h->sumNs / h->count / 1000 : 0),
+                        (unsigned long long)histQuantile(h, 0.5),
+                        (unsigned long long)histQuantile(h, 0.9),
+                        (unsigned long long)histQuantile(h, 0.99),
+                        (unsigned long long)(h->maxNs / 1000));
+        }
+}
+
+static void
+textSnapshot(struct buf *b, struct randrResources *r)
+{
+        if (!r) {
+                bprintf(b, "snapshot none\n");
+                return;
+        }
+        bprintf(b, "snapshot fingerprint=%016llx age_ms=%llu primary=0x%x "
+                "outputs=%d crtcs=%d\n",
+                (unsigned long long)r->fingerprint,
+                (unsigned long long)(monotonicNs() - r->taken) / 1000000,
+                r->primary, r->noutput, r->ncrtc);
+        for (int i = 0; i < r->noutput; ++i) {
+                struct randrOutput *o = &r->outputs[i];
+                struct randrMode *m = o->npreferred > 0 ?
+                        findMode(r, o->modes[0]) : NULL;
+                char edid[16];
+                bprintf(b, "output id=0x%x name=%s connection=%s crtc=0x%x "
+                        "mm=%lux%lu modes=%d preferred=%s edid=%s\n",
+                        o->id, o->name, connectionName(o->connection),
+                        o->crtc, o->mmWidth, o->mmHeight, o->nmode,
+                        m ? m->name : "none",
+                        edidId(o, edid) ? edid : "none");
+        }
+        for (int i = 0; i < r->ncrtc; ++i) {
+                struct randrCrtc *c = &r->crtcs[i];
+                struct randrMode *m = findMode(r, c->mode);
+                bprintf(b, "crtc id=0x%x mode=%s geometry=%ux%u+%d+%d "
+                        "outputs=", c->id, m ? m->name : "none",
+                        c->width, c->height, c->x, c->y);
+                for (int j = 0; j < c->noutput; ++j)
+                        bprintf(b, "%s0x%x", j ? "," : "", c->outputs[j]);
+                bprintf(b, "%s\n", c->noutput ? "" : "none");
+        }
+}
+
+static void
+json(struct buf *b, struct randrResources *r)
+{
+        bprintf(b, "{\"counters\":{");
+        for (int i = 0; i < NELEM(counters); ++i)
+                bprintf(b, "%s\"%s\":%lu", i ? "," : "", counters[i].name,
+                        *counters[i].value);
+        bprintf(b, "},\"histograms\":{");
+        for (int i = 0; i < NELEM(histograms); ++i) {
+                struct histogram *h = histograms[i].h;
+                bprintf(b, "%s\"%s\":{\"count\":%lu,\"sum_us\":%llu,"
+                        "\"max_us\":%llu,\"buckets\":[", i ? "," : "",
+                        histograms[i].name, h->count,
+                        (unsigned long long)(h->sumNs / 1000),
+                        (unsigned long long)(h->maxNs / 1000));
+                // Buckets as [upper bound in us, count], with null for
+                // the unbounded one.  Skip empty buckets.
+                bool first = true;
+                for (int j = 0; j <= HIST_BUCKETS; ++j) {
+                        if (!h->buckets[j])
+                                continue;
+                        if (j < HIST_BUCKETS)
+                                bprintf(b, "%s[%llu,%lu]", first ? "" : ",",
+                                        (unsigned long long)histBound(j),
+                                        h->buckets[j]);
+                        else
+                                bprintf(b, "%s[null,%lu]", first ? "" : ",",
+                                        h->buckets[j]);
+                        first = false;
+                }
+                bprintf(b, "]}");
+        }
+        bprintf(b, "},\"snapshot\":");
+        if (!r) {
+                bprintf(b, "null}\n");
+                return;
+        }
+        bprintf(b, "{\"fingerprint\":\"%016llx\",\"age_ms\":%llu,"
+                "\"primary\":%u,\"outputs\":[",
+                (unsigned long long)r->fingerprint,
+                (unsigned long long)(monotonicNs() - r->taken) / 1000000,
+                r->primary);
+        for (int i = 0; i < r->noutput; ++i) {
+                struct randrOutput *o = &r->outputs[i];
+                char edid[16];
+                bprintf(b, "%s{\"id\":%u,\"name\":", i ? "," : "", o->id);
+                jsonString(b, o->name);
+                bprintf(b, ",\"connection\":\"%s\",\"crtc\":%u,"
+                        "\"mm_width\":%lu,\"mm_height\":%lu,\"edid\":",
+                        connectionName(o->connection), o->crtc,
+                        o->mmWidth, o->mmHeight);
+                if (edidId(o, edid))
+                        bprintf(b, "\"%s\"", edid);
+                else
+                        bprintf(b, "null");
+                bprintf(b, ",\"modes\":[");
+                bool first = true;
+                for (int j = 0; j < o->nmode; ++j) {
+                        struct randrMode *m = findMode(r, o->modes[j]);
+                        if (!m)
+                                continue;
+                        bprintf(b, "%s{\"name\":", first ? "" : ",");
+                        first = false;
+                        jsonString(b, m->name);
+                        bprintf(b, ",\"width\":%u,\"height\":%u,"
+                                "\"dot_clock\":%lu,\"preferred\":%s}",
+                                m->width, m->height, m->dotClock,
+                                j < o->npreferred ? "true" : "false");
+                }
+                bprintf(b, "]}");
+        }
+        bprintf(b, "],\"crtcs\":[");
+        for (int i = 0; i < r->ncrtc; ++i) {
+                struct randrCrtc *c = &r->crtcs[i];
+                bprintf(b, "%s{\"id\":%u,\"mode\":%u,\"x\":%d,\"y\":%d,"
+                        "\"width\":%u,\"height\":%u,\"outputs\":[",
+                        i ? "," : "", c->id, c->mode, c->x, c->y,
+                        c->width, c->height);
+                for (int j = 0; j < c->noutput; ++j)
+                        bprintf(b, "%s%u", j ? "," : "", c->outputs[j]);
+                bprintf(b, "]}");
+        }
+        bprintf(b, "]}}\n");
+}
+
+int
+statusListen(const char *path)
+{
+        struct sockaddr_un addr = {.sun_family = AF_UNIX};
+        if (strlen(path) >= sizeof addr.sun_path) {
+                fprintf(stderr, "Socket path too long: %s\n", path);
+                return -1;
+        }
+        strcpy(addr.sun_path, path);
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                        0);
+        if (fd < 0) {
+                perror("socket");
+                return -1;
+        }
+        // Replace a socket left behind by an earlier run
+        unlink(path);
+        if (bind(fd, (struct sockaddr*)&addr, sizeof addr) < 0 ||
+            listen(fd, 8) < 0) {
+                perror(path);
+                close(fd);
+                return -1;
+        }
+        return fd;
+}
+
+// A connected client, and as much of its request as has arrived
+struct client
+{
+        int fd;
+        uint64_t deadline;
+        size_t len;
+        char req[64];
+};
+
+static struct client *clients;
+static int nclients, clientsCap;
+
+int
+statusAccept(int listenFd)
+{
+        int fd = accept4(listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+                if (errno != EAGAIN && errno != EINTR)
+                        perror("accept4");
+                return fd;
+        }
+        if (nclients == clientsCap) {
+                clientsCap = clientsCap ? 2 * clientsCap : 8;
+                clients = realloc(clients, clientsCap * sizeof *clients);
+                if (!clients) {
+                        fprintf(stderr, "Out of memory\n");
+                        exit(1);
+                }
+        }
+        clients[nclients++] = (struct client){
+                fd, monotonicNs() + STATUS_TIMEOUT_MS * 1000000ull};
+        return fd;
+}
+
+static void
+forgetClient(struct client *c)
+{
+        *c = clients[--nclients];
+}
+
+int
+statusWait(int timeout)
+{
+        if (nclients == 0)
+                return timeout;
+        uint64_t first = clients[0].deadline, now = monotonicNs();
+        for (int i = 1; i < nclients; ++i)
+                if (clients[i].deadline < first)
+                        first = clients[i].deadline;
+        // Round up, so we don't wake up just before the deadline
+        int64_t left = first > now ? (first - now) / 1000000 + 1 : 0;
+        return timeout < 0 || left < timeout ? left : timeout;
+}
+
+int
+statusExpired(void)
+{
+        uint64_t now = monotonicNs();
+        for (int i = 0; i < nclients; ++i) {
+                if (clients[i].deadline <= now) {
+                        int fd = clients[i].fd;
+                        forgetClient(&clients[i]);
+                        return fd;
+                }
+        }
+        return -1;
+}
+
+bool
+statusServe(int fd, struct randrResources *current)
+{
+        struct client *c = NULL;
+        for (int i = 0; i < nclients; ++i)
+                if (clients[i].fd == fd)
+                        c = &clients[i];
+        if (!c)
+                return true;
+        // The request can arrive in pieces.  Wait for the end of
+        // the line, or of the stream.
+        ssize_t n = read(fd, c->req + c->len, sizeof c->req - 1 - c->len);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR))
+                return false;
+        if (n > 0) {
+                c->len += n;
+                c->req[c->len] = 0;
+                if (!strchr(c->req, '\n') && c->len < sizeof c->req - 1)
+                        return false;
+        }
+        char req[sizeof c->req];
+        memcpy(req, c->req, c->len);
+        req[c->len] = 0;
+        req[strcspn(req, "\r\n")] = 0;
+        forgetClient(c);
+
+        stats.statusRequests++;
+        struct buf b = {};
+        if (strcmp(req, "stats") == 0 || req[0] == 0) {
+                textStats(&b);
+        } else if (strcmp(req, "snapshot") == 0) {
+                textSnapshot(&b, current);
+        } else if (strcmp(req, "json") == 0) {
+                json(&b, current);
+        } else {
+                bprintf(&b, "error unknown request; "
+                        "try stats, snapshot or json\n");
+        }
+        // Answers fit easily in the socket buffer.  If the client
+        // won't take it, it loses it rather than stalling us.
+        for (size_t off = 0; off < b.len; ) {
+                ssize_t w = send(fd, b.data + off, b.len - off, MSG_NOSIGNAL);
+                if (w <= 0)
+                        break;
+                off += w;
+        }
+        free(b.data);
+        return true;
+}
@@ -0,0 +1,514 @@
+// The X server backend: snapshots and layouts over XCB (or Xlib),
+// and RandR events from the root window.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <X11/Xlib.h>
+#include <X11/Xlib-xcb.h>
+#include <X11/extensions/Xrandr.h>
+#include <xcb/randr.h>
+
+#include "xrandrd.h"
+
+static Display *dpy;
+static xcb_connection_t *conn;
+static Window root;
+
+// Take snapshots through Xlib instead of XCB.  Xlib makes a round
+// trip for every output and CRTC, so this is mostly useful for
+// comparing the two.
+static bool useXlib;
+
+// Whether the server supports GetScreenResourcesCurrent (RandR 1.3)
+static bool haveCurrent;
+
+static int rrEvent;
+static Atom edidAtom;
+
+// Xlib keeps IDs in longs
+static uint32_t *
+copyXIDs(const XID *ids, int n)
+{
+        uint32_t *res = xmalloc(n * sizeof *res);
+        for (int i = 0; i < n; ++i)
+                res[i] = ids[i];
+        return res;
+}
+
+// Longest EDID we'll read, in 32-bit units.  Base EDID is 128 bytes
+// and each extension block adds 128.
+#define EDID_MAX_LONGS 256
+
+// Outputs and CRTCs can vanish while we're taking a snapshot, say
+// when a USB display adapter is unplugged.  Xlib's default handler
+// would exit on the resulting errors; the request returns NULL
+// instead, and the caller tries again.
+static int
+ignoreXError(Display *d, XErrorEvent *ev)
+{
+        (void)d;
+        (void)ev;
+        return 0;
+}
+
+static struct randrResources *
+getRandrResourcesXlib(bool probe)
+{
+        XRRScreenResources *res = probe ?
+                XRRGetScreenResources(dpy, root) :
+                XRRGetScreenResourcesCurrent(dpy, root);
+        if (!res)
+                return NULL;
+
+        struct randrResources *r = xmalloc(sizeof *r);
+        memset(r, 0, sizeof *r);
+        r->timestamp = res->timestamp;
+        r->configTimestamp = res->configTimestamp;
+
+        r->nmode = res->nmode;
+        r->modes = xmalloc(r->nmode * sizeof *r->modes);
+        for (int i = 0; i < r->nmode; ++i) {
+                XRRModeInfo *mi = &res->modes[i];
+                r->modes[i] = (struct randrMode){
+                        mi->id, mi->width, mi->height, mi->dotClock,
+                        mi->hTotal, mi->vTotal, mi->modeFlags,
+                        copyName(mi->name, mi->nameLength)};
+        }
+
+        r->noutput = res->noutput;
+        r->outputs = xmalloc(r->noutput * sizeof *r->outputs);
+        for (int i = 0; i < r->noutput; ++i) {
+                XRROutputInfo *oi = XRRGetOutputInfo(dpy, res,
+                                                     res->outputs[i]);
+                if (!oi) {
+                        r->noutput = i;
+                        goto fail;
+                }
+                r->outputs[i] = (struct randrOutput){
+                        res->outputs[i], copyName(oi->name, oi->nameLen),
+                        oi->connection, oi->crtc, oi->mm_width, oi->mm_height,
+                        oi->ncrtc, oi->nmode, oi->npreferred,
+                        copyXIDs(oi->crtcs, oi->ncrtc),
+                        copyXIDs(oi->modes, oi->nmode)};
+                XRRFreeOutputInfo(oi);
+
+                Atom type;
+                int format;
+                unsigned long nitems, after;
+                unsigned char *data;
+                if (XRRGetOutputProperty(dpy, res->outputs[i], edidAtom, 0,
+                                         EDID_MAX_LONGS, False, False,
+                                         AnyPropertyType, &type, &format,
+                                         &nitems, &after, &data) == Success) {
+                        if (format == 8 && nitems > 0) {
+                                r->outputs[i].edid = xmalloc(nitems);
+                                memcpy(r->outputs[i].edid, data, nitems);
+                                r->outputs[i].edidLen = nitems;
+                        }
+                        XFree(data);
+                }
+        }
+
+        r->ncrtc = res->ncrtc;
+        r->crtcs = xmalloc(r->ncrtc * sizeof *r->crtcs);
+        for (int i = 0; i < r->ncrtc; ++i) {
+                XRRCrtcInfo *ci = XRRGetCrtcInfo(dpy, res, res->crtcs[i]);
+                if (!ci) {
+                        r->ncrtc = i;
+                        goto fail;
+                }
+                r->crtcs[i] = (struct randrCrtc){
+                        res->crtcs[i], ci->x, ci->y, ci->width, ci->height,
+                        ci->mode, ci->rotation, ci->rotations,
+                        ci->noutput, ci->npossible,
+                        copyXIDs(ci->outputs, ci->noutput),
+                        copyXIDs(ci->possible, ci->npossible)};
+                XRRFreeCrtcInfo(ci);
+        }
+
+        r->primary = haveCurrent ? XRRGetOutputPrimary(dpy, root) : 0;
+        XRRFreeScreenResources(res);
+        return r;
+
+fail:
+        freeRandrResources(r);
+        XRRFreeScreenResources(res);
+        return NULL;
+}
+
+// The parts of a GetScreenResources or GetScreenResourcesCurrent
+// reply, which have the same layout but separate accessors.
+struct xcbScreenResources
+{
+        void *reply;
+        xcb_timestamp_t timestamp, configTimestamp;
+        xcb_randr_output_t *outputs;
+        xcb_randr_crtc_t *crtcs;
+        xcb_randr_mode_info_t *modes;
+        const uint8_t *names;
+        int noutput, ncrtc, nmode;
+};
+
+#define XCB_SCREEN_RESOURCES(res, req, rep)                             \
+        do {                                                            \
+                rep *__r = req##_reply(conn, req(conn, root), NULL);    \
+                if (!__r)                                               \
+                        break;                                          \
+                (res) = (struct xcbScreenResources){                    \
+                        __r, __r->timestamp, __r->config_timestamp,     \
+                        req##_outputs(__r), req##_crtcs(__r),           \
+                        req##_modes(__r), req##_names(__r),             \
+                        req##_outputs_length(__r),                      \
+                        req##_crtcs_length(__r),                        \
+                        req##_modes_length(__r)};                       \
+        } while (0)
+
+static struct randrResources *
+getRandrResourcesXCB(bool probe)
+{
+        struct xcbScreenResources res = {};
+        if (probe)
+                XCB_SCREEN_RESOURCES(
+                        res, xcb_randr_get_screen_resources,
+                        xcb_randr_get_screen_resources_reply_t);
+        else
+                XCB_SCREEN_RESOURCES(
+                        res, xcb_randr_get_screen_resources_current,
+                        xcb_randr_get_screen_resources_current_reply_t);
+        if (!res.reply)
+                return NULL;
+
+        struct randrResources *r = xmalloc(sizeof *r);
+        memset(r, 0, sizeof *r);
+        r->timestamp = res.timestamp;
+        r->configTimestamp = res.configTimestamp;
+
+        // Send every GetOutputInfo, EDID and GetCrtcInfo request
+        // before waiting on any of them, so they all go out in the
+        // flush for the first reply and the whole snapshot costs two
+        // round trips.  We don't know yet which outputs are
+        // connected, so ask for every output's EDID.
+        xcb_randr_output_t *outputs = res.outputs;
+        r->noutput = res.noutput;
+        xcb_randr_get_output_info_cookie_t *oc =
+                xmalloc(r->noutput * sizeof *oc);
+        xcb_randr_get_output_property_cookie_t *ec =
+                xmalloc(r->noutput * sizeof *ec);
+        for (int i = 0; i < r->noutput; ++i) {
+                oc[i] = xcb_randr_get_output_info(conn, outputs[i],
+                                                  res.configTimestamp);
+                ec[i] = xcb_randr_get_output_property(
+                        conn, outputs[i], edidAtom, XCB_ATOM_ANY, 0,
+                        EDID_MAX_LONGS, 0, 0);
+        }
+        xcb_randr_get_output_primary_cookie_t pc;
+        if (haveCurrent)
+                pc = xcb_randr_get_output_primary(conn, root);
+        xcb_randr_crtc_t *crtcs = res.crtcs;
+        r->ncrtc = res.ncrtc;
+        xcb_randr_get_crtc_info_cookie_t *cc = xmalloc(r->ncrtc * sizeof *cc);
+        for (int i = 0; i < r->ncrtc; ++i)
+                cc[i] = xcb_randr_get_crtc_info(conn, crtcs[i],
+                                                res.configTimestamp);
+
+        // Modes and their names come with the screen resources
+        xcb_randr_mode_info_t *modes = res.modes;
+        const uint8_t *names = res.names;
+        r->nmode = res.nmode;
+        r->modes = xmalloc(r->nmode * sizeof *r->modes);
+        for (int i = 0; i < r->nmode; ++i) {
+                xcb_randr_mode_info_t *mi = &modes[i];
+                r->modes[i] = (struct randrMode){
+                        mi->id, mi->width, mi->height, mi->dot_clock,
+                        mi->htotal, mi->vtotal, mi->mode_flags,
+                        copyName(names, mi->name_len)};
+                names += mi->name_len;
+        }
+
+        r->outputs = xmalloc(r->noutput * sizeof *r->outputs);
+        for (int i = 0; i < r->noutput; ++i) {
+                xcb_randr_get_output_info_reply_t *oi =
+                        xcb_randr_get_output_info_reply(conn, oc[i], NULL);
+                if (!oi) {
+                        // Drop the replies we won't read.  The CRTCs
+                        // haven't been filled in yet.
+                        for (int j = i; j < r->noutput; ++j) {
+                                if (j > i)
+                                        xcb_discard_reply(conn,
+                                                          oc[j].sequence);
+                                xcb_discard_reply(conn, ec[j].sequence);
+                        }
+                        if (haveCurrent)
+                                xcb_discard_reply(conn, pc.sequence);
+                        for (int j = 0; j < r->ncrtc; ++j)
+                                xcb_discard_reply(conn, cc[j].sequence);
+                        r->noutput = i;
+                        r->ncrtc = 0;
+                        goto fail;
+                }
+                r->outputs[i] = (struct randrOutput){
+                        outputs[i],
+                        copyName(xcb_randr_get_output_info_name(oi),
+                                 xcb_randr_get_output_info_name_length(oi)),
+                        oi->connection, oi->crtc, oi->mm_width, oi->mm_height,
+                        oi->num_crtcs, oi->num_modes, oi->num_preferred,
+                        copyIds(xcb_randr_get_output_info_crtcs(oi),
+                                oi->num_crtcs),
+                        copyIds(xcb_randr_get_output_info_modes(oi),
+                                oi->num_modes)};
+                free(oi);
+
+                xcb_randr_get_output_property_reply_t *ep =
+                        xcb_randr_get_output_property_reply(conn, ec[i],
+                                                            NULL);
+                int len = ep ? xcb_randr_get_output_property_data_length(ep) : 0;
+                if (ep && ep->format == 8 && len > 0) {
+                        r->outputs[i].edid = xmalloc(len);
+                        memcpy(r->outputs[i].edid,
+                               xcb_randr_get_output_property_data(ep), len);
+                        r->outputs[i].edidLen = len;
+                }
+                free(ep);
+        }
+        if (haveCurrent) {
+                xcb_randr_get_output_primary_reply_t *pr =
+                        xcb_randr_get_output_primary_reply(conn, pc, NULL);
+                if (pr)
+                        r->primary = pr->output;
+                free(pr);
+        }
+        r->crtcs = xmalloc(r->ncrtc * sizeof *r->crtcs);
+        for (int i = 0; i < r->ncrtc; ++i) {
+                xcb_randr_get_crtc_info_reply_t *ci =
+                        xcb_randr_get_crtc_info_reply(conn, cc[i], NULL);
+                if (!ci) {
+                        for (int j = i + 1; j < r->ncrtc; ++j)
+                                xcb_discard_reply(conn, cc[j].sequence);
+                        r->ncrtc = i;
+                        goto fail;
+                }
+                r->crtcs[i] = (struct randrCrtc){
+                        crtcs[i], ci->x, ci->y, ci->width, ci->height,
+                        ci->mode, ci->rotation, ci->rotations,
+                        ci->num_outputs, ci->num_possible_outputs,
+                        copyIds(xcb_randr_get_crtc_info_outputs(ci),
+                                ci->num_outputs),
+                        copyIds(xcb_randr_get_crtc_info_possible(ci),
+                                ci->num_possible_outputs)};
+                free(ci);
+        }
+
+        free(oc);
+        free(ec);
+        free(cc);
+        free(res.reply);
+        return r;
+
+fail:
+        freeRandrResources(r);
+        free(oc);
+        free(ec);
+        free(cc);
+        free(res.reply);
+        return NULL;
+}
+
+// Set the CRTCs in r to match l (and turn off any others), grabbing
+// the server so clients never see a half-configured screen.  Requests
+// are pipelined in three phases: turn off CRTCs that are changing,
+// resize the screen, then turn on the new configuration.
+static bool
+applyLayout(struct randrResources *r, struct layout *l)
+{
+        if (l->n == 0) {
+                printf("Nothing to lay out\n");
+                return false;
+        }
+
+        xcb_randr_set_crtc_config_cookie_t *cc =
+                xmalloc(r->ncrtc * sizeof *cc);
+        bool *sent = xmalloc(r->ncrtc * sizeof *sent);
+        bool ok = true;
+        xcb_grab_server(conn);
+
+        for (int i = 0; i < r->ncrtc; ++i) {
+                struct randrCrtc *c = &r->crtcs[i];
+                struct layoutOutput *lo = layoutCrtc(l, c->id);
+                sent[i] = c->mode && !(lo && crtcMatches(c, lo));
+                if (sent[i])
+                        cc[i] = xcb_randr_set_crtc_config(
+                                conn, c->id, XCB_CURRENT_TIME,
+                                r->configTimestamp, 0, 0, XCB_NONE,
+                                XCB_RANDR_ROTATION_ROTATE_0, 0, NULL);
+        }
+        for (int i = 0; i < r->ncrtc; ++i) {
+                if (!sent[i])
+                        continue;
+                xcb_randr_set_crtc_config_reply_t *rep =
+                        xcb_randr_set_crtc_config_reply(conn, cc[i], NULL);
+                if (!rep || rep->status != XCB_RANDR_SET_CONFIG_SUCCESS)
+                        ok = false;
+                free(rep);
+        }
+        if (!ok)
+                goto out;
+
+        if (l->width != (unsigned)DisplayWidth(dpy, DefaultScreen(dpy)) ||
+            l->height != (unsigned)DisplayHeight(dpy, DefaultScreen(dpy))) {
+                // Keep the physical size at 96 DPI
+                xcb_generic_error_t *err = xcb_request_check(
+                        conn, xcb_randr_set_screen_size_checked(
+                                conn, root, l->width, l->height,
+                                l->width * 254 / 960, l->height * 254 / 960));
+                if (err) {
+                        fprintf(stderr, "Failed to set screen size to %ux%u\n",
+                                l->width, l->height);
+                        free(err);
+                        ok = false;
+                        goto out;
+                }
+        }
+
+        for (int i = 0; i < l->n; ++i) {
+                struct layoutOutput *lo = &l->outputs[i];
+                struct randrCrtc *c = findCrtc(r, lo->crtc);
+                sent[i] = !crtcMatches(c, lo);
+                if (sent[i])
+                        cc[i] = xcb_randr_set_crtc_config(
+                                conn, lo->crtc, XCB_CURRENT_TIME,
+                                r->configTimestamp, lo->x, lo->y, lo->mode,
+                                lo->rotation, 1, &lo->output);
+        }
+        if (haveCurrent && l->primary && l->primary != r->primary)
+                xcb_randr_set_output_primary(conn, root, l->primary);
+        for (int i = 0; i < l->n; ++i) {
+                if (!sent[i])
+                        continue;
+                xcb_randr_set_crtc_config_reply_t *rep =
+                        xcb_randr_set_crtc_config_reply(conn, cc[i], NULL);
+                if (!rep || rep->status != XCB_RANDR_SET_CONFIG_SUCCESS)
+                        ok = false;
+                free(rep);
+        }
+
+out:
+        xcb_ungrab_server(conn);
+        xcb_flush(conn);
+        if (!ok)
+                fprintf(stderr, "Failed to apply layout\n");
+        free(cc);
+        free(sent);
+        return ok;
+}
+
+// Classify ev.  Screen changes follow any CRTC change, so they don't
+// call for anything by themselves.
+static enum change
+handleEvent(XEvent *ev)
+{
+        if (ev->type == rrEvent + RRScreenChangeNotify) {
+                XRRUpdateConfiguration(ev);
+                return CHANGE_NONE;
+        }
+        if (ev->type != rrEvent + RRNotify) {
+                printf("Unexpected X event: %d\n", ev->type);
+                return CHANGE_NONE;
+        }
+        XRRNotifyEvent *nev = (XRRNotifyEvent*)ev;
+        switch (nev->subtype) {
+        case RRNotify_OutputChange:
+                return CHANGE_TOPOLOGY;
+        case RRNotify_OutputProperty:
+                // Only a new EDID matters.  Drivers also report
+                // things like backlight changes this way.
+                if (((XRROutputPropertyNotifyEvent*)ev)->property == edidAtom)
+                        return CHANGE_TOPOLOGY;
+                return CHANGE_NONE;
+        case RRNotify_CrtcChange:
+                return CHANGE_LAYOUT;
+        default:
+                printf("Unexpected RandR event: %d\n", nev->subtype);
+                return CHANGE_NONE;
+        }
+}
+
+// Handle every X event that's already arrived.  Return the number
+// handled and raise *change to the most any of them called for.
+static int
+drainX(enum change *change)
+{
+        int n = 0;
+        while (XPending(dpy)) {
+                XEvent ev;
+                XNextEvent(dpy, &ev);
+                enum change c = handleEvent(&ev);
+                if (c > *change)
+                        *change = c;
+                n++;
+        }
+        return n;
+}
+
+static struct randrResources *
+xFetch(bool probe)
+{
+        if (!useXlib)
+                return getRandrResourcesXCB(probe);
+        // Keep errors from earlier requests out of ignoreXError.
+        XSync(dpy, False);
+        XErrorHandler old = XSetErrorHandler(ignoreXError);
+        struct randrResources *r = getRandrResourcesXlib(probe);
+        XSync(dpy, False);
+        XSetErrorHandler(old);
+        return r;
+}
+
+struct backend *
+xOpen(bool xlib)
+{
+        static struct backend b = {
+                .fetch = xFetch,
+                .apply = applyLayout,
+                .drain = drainX,
+        };
+        int rrError;
+
+        // Open the X display and check for Xrandr
+        dpy = XOpenDisplay(NULL);
+        if (!dpy) {
+                fprintf(stderr, "Can't open display %s\n", XDisplayName(NULL));
+                exit(1);
+        }
+        conn = XGetXCBConnection(dpy);
+        root = RootWindow(dpy, DefaultScreen(dpy));
+        int major, minor;
+        if (!XRRQueryVersion (dpy, &major, &minor)) {
+                fprintf(stderr, "RandR extension missing\n");
+                exit(1);
+        }
+        if (major < 0 || (major == 1 && minor < 2)) {
+                fprintf(stderr, "Requires RandR >= 1.2\n");
+                exit(1);
+        }
+        haveCurrent = major > 1 || minor >= 3;
+
+        // Get Xrandr event base
+        if (!XRRQueryExtension(dpy, &rrEvent, &rrError)) {
+                fprintf(stderr, "Failed to query RandR extension\n");
+                exit(1);
+        }
+
+        edidAtom = XInternAtom(dpy, "EDID", False);
+
+        // Monitor xrandr events on the root window
+        XRRSelectInput(dpy, root,
+                       RRScreenChangeNotifyMask | RRCrtcChangeNotifyMask |
+                       RROutputChangeNotifyMask | RROutputPropertyNotifyMask);
+
+        useXlib = xlib;
+        b.name = useXlib ? "Xlib" : "XCB";
+        b.cheapSnapshots = haveCurrent;
+        b.fd = ConnectionNumber(dpy);
+        return &b;
+}
@@ -1,5 +1,6 @@
-// Run "xauto" to reconfigure xrandr whenever the physical screen
-// configuration changes.
+// Reconfigure the screen with RandR whenever the physical screen
+// configuration changes, either with a built-in layout or by running
+// a command such as "xauto".
 
 // Recent xf86-video-intel drivers (2.13.0+) generate the necessary
 // Xrandr events on monitor hot plug.  See
@@ -7,141 +8,1454 @@
 
 // See also http://git.gnome.org/browse/gnome-settings-daemon/tree/plugins/xrandr/gsd-xrandr-manager.c
 
-// XXX Doesn't notice output changes that happen during suspend.
-// Unfortunately, there's no easy way to detect resume events (at
-// least, until DeviceKit becomes popular).  Could use the ConsoleKit
-// D-Bus events.  Could use a CLOCK_REALTIME timer with a longish
-// period (say, 30 seconds) and see if we get woken up much later than
-// 30 seconds.  This won't detect <30 second suspends, but will fire
-// the moment the system resumes (unlike CLOCK_MONOTONIC).
-// CLOCK_MONOTONIC would detect short suspends, but would take a while
-// to do so.
+// Not every driver reports every connector change, and nothing
+// reports changes that happen during suspend, so we also watch for
+// DRM hotplug uevents from udev and for resume.  The kernel cancels
+// CLOCK_REALTIME timerfds with TFD_TIMER_CANCEL_ON_SET whenever the
+// wall clock jumps, which includes resume, so that tells us the
+// moment the system wakes up.  Either makes us ask the server to
+// re-probe the hardware.
 
+#define _GNU_SOURCE /* asprintf */
+#include <errno.h>
+#include <signal.h>
+#include <spawn.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <X11/Xlib.h>
-#include <X11/extensions/Xrandr.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+#include <libudev.h>
 
-struct randrResources
+#include "xrandrd.h"
+
+static struct backend *backend;
+
+// How long the event stream has to be quiet before we act on a burst
+// of events, in milliseconds.  A single hotplug produces several.
+static int quietMs = 250;
+
+// Act on a burst after this long even if it hasn't quieted down, so a
+// steady trickle of events can't hold off a snapshot forever.
+#define MAX_BURST_MS 5000
+
+// Give up on a snapshot after it fails this many times in a row
+#define FETCH_TRIES 10
+
+// If set, run this command to reconfigure the screen instead of
+// using the built-in layout
+static const char *reconfigCommand;
+
+// If set, serve status requests on a Unix socket here
+static const char *statusPath;
+
+// Kill reconfigCommand if it runs longer than this, in milliseconds
+static int reconfigTimeoutMs = 10000;
+
+// Complain when the screen takes longer than this to be configured
+// after the first event of a change, in milliseconds
+static int latencyBudgetMs = 1000;
+
+// Monotonic time of the first event of the change being handled
+static uint64_t changeStart;
+
+// The time from the first event to configured of every
+// reconfiguration, in milliseconds, for the replay report
+static double *latencies;
+static int nlatencies, latenciesCap;
+
+void *
+xmalloc(size_t size)
 {
-        XRRScreenResources *res;
-        XRROutputInfo **outputs;
-};
+        void *p = malloc(size ? size : 1);
+        if (!p) {
+                fprintf(stderr, "Out of memory\n");
+                exit(1);
+        }
+        return p;
+}
 
-static Display *dpy;
-static Window root;
+uint32_t *
+copyIds(const uint32_t *ids, int n)
+{
+        uint32_t *res = xmalloc(n * sizeof *res);
+        memcpy(res, ids, n * sizeof *res);
+        return res;
+}
 
-struct randrResources *
-getRandrResources(void)
+char *
+copyName(const void *name, int len)
+{
+        char *res = xmalloc(len + 1);
+        memcpy(res, name, len);
+        res[len] = 0;
+        return res;
+}
+
+uint64_t
+monotonicNs(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+struct randrMode *
+findMode(struct randrResources *r, uint32_t id)
+{
+        for (int i = 0; i < r->nmode; ++i)
+                if (r->modes[i].id == id)
+                        return &r->modes[i];
+        return NULL;
+}
+
+struct randrCrtc *
+findCrtc(struct randrResources *r, uint32_t id)
+{
+        for (int i = 0; i < r->ncrtc; ++i)
+                if (r->crtcs[i].id == id)
+                        return &r->crtcs[i];
+        return NULL;
+}
+
+// Pick the mode to drive o with: its preferred mode if it has one,
+// otherwise the largest.
+static struct randrMode *
+pickMode(struct randrResources *r, struct randrOutput *o)
+{
+        if (o->npreferred > 0)
+                return findMode(r, o->modes[0]);
+        struct randrMode *best = NULL;
+        for (int i = 0; i < o->nmode; ++i) {
+                struct randrMode *m = findMode(r, o->modes[i]);
+                if (m && (!best || m->width * m->height >
+                          best->width * best->height))
+                        best = m;
+        }
+        return best;
+}
+
+void
+freeRandrResources(struct randrResources *r)
+{
+        for (int i = 0; i < r->nmode; ++i)
+                free(r->modes[i].name);
+        for (int i = 0; i < r->noutput; ++i) {
+                free(r->outputs[i].name);
+                free(r->outputs[i].crtcs);
+                free(r->outputs[i].modes);
+                free(r->outputs[i].edid);
+        }
+        for (int i = 0; i < r->ncrtc; ++i) {
+                free(r->crtcs[i].outputs);
+                free(r->crtcs[i].possible);
+        }
+        free(r->modes);
+        free(r->outputs);
+        free(r->crtcs);
+        free(r);
+}
+
+static struct randrResources *
+fetchRandrResources(bool probe)
 {
+        uint64_t start = monotonicNs();
         struct randrResources *r;
-        if (!(r = malloc(sizeof *r)) ||
-            !(r->res = XRRGetScreenResources(dpy, root)) ||
-            !(r->outputs = malloc(r->res->noutput * sizeof *r->outputs)))
-                goto bad;
-        for (int i = 0; i < r->res->noutput; ++i) {
-                r->outputs[i] = XRRGetOutputInfo(dpy, r->res,
-                                                 r->res->outputs[i]);
-                if (!r->outputs[i])
-                        goto bad;
-                printf("%s %d\n", r->outputs[i]->name, r->outputs[i]->connection);
+        // A snapshot fails if an output or CRTC vanishes while it's
+        // being taken, which is exactly what unplugging a USB display
+        // adapter does.  The next one will see the new resources.
+        for (int tries = 1; !(r = backend->fetch(probe)); ++tries) {
+                if (tries == FETCH_TRIES) {
+                        fprintf(stderr, "Failed to get screen resources\n");
+                        exit(1);
+                }
+                printf("Screen resources changed during snapshot; "
+                       "retrying\n");
         }
+        histAdd(probe ? &stats.fetchProbed : &stats.fetchCurrent,
+                monotonicNs() - start);
         return r;
+}
 
-bad:
-        fprintf(stderr, "Failed to get screen resources\n");
-        exit(1);
+static uint64_t
+fnv1a(uint64_t h, const void *data, size_t len)
+{
+        const unsigned char *p = data;
+        for (size_t i = 0; i < len; ++i) {
+                h ^= p[i];
+                h *= 0x100000001b3ull;
+        }
+        return h;
 }
 
+static int
+compareU64(const void *a, const void *b)
+{
+        uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+        return x < y ? -1 : x > y;
+}
+
+// Reduce r to a fingerprint of what's plugged in: a hash of each
+// connected output's name, EDID and preferred mode, combined in
+// sorted order so the order the server lists outputs in doesn't
+// matter.  Mode IDs can be renumbered, so modes are identified by
+// their timings.
+static uint64_t
+fingerprint(struct randrResources *r)
+{
+        uint64_t *hashes = xmalloc(r->noutput * sizeof *hashes);
+        int n = 0;
+        for (int i = 0; i < r->noutput; ++i) {
+                struct randrOutput *o = &r->outputs[i];
+                if (o->connection != RR_Connected)
+                        continue;
+                uint64_t h = 0xcbf29ce484222325ull;
+                h = fnv1a(h, o->name, strlen(o->name) + 1);
+                h = fnv1a(h, o->edid, o->edidLen);
+                struct randrMode *m = pickMode(r, o);
+                if (m) {
+                        unsigned long timings[] = {m->width, m->height,
+                                                   m->dotClock, m->hTotal,
+                                                   m->vTotal, m->flags};
+                        h = fnv1a(h, timings, sizeof timings);
+                }
+                hashes[n++] = h;
+        }
+        qsort(hashes, n, sizeof *hashes, compareU64);
+        uint64_t h = fnv1a(0xcbf29ce484222325ull, hashes, n * sizeof *hashes);
+        free(hashes);
+        return h;
+}
+
+// Return whether a snapshot taken without probing may be out of date.
+// The server only knows about connectors that it has probed or that
+// the driver told it about, so no outputs at all, an output in an
+// unknown state or a connected output with no modes means it hasn't
+// looked yet.
+static bool
+snapshotAmbiguous(struct randrResources *r)
+{
+        if (r->noutput == 0)
+                return true;
+        for (int i = 0; i < r->noutput; ++i) {
+                struct randrOutput *o = &r->outputs[i];
+                if (o->connection == RR_UnknownConnection ||
+                    (o->connection == RR_Connected && o->nmode == 0))
+                        return true;
+        }
+        return false;
+}
+
+// Take a snapshot.  Unless probe is set, this uses the server's
+// current view of the outputs, which is cheap, and only makes the
+// server re-probe every connector (which reads EDIDs and stalls the
+// whole server) if that view looks incomplete.
+struct randrResources *
+getRandrResources(bool probe)
+{
+        uint64_t start = monotonicNs();
+        if (!backend->cheapSnapshots)
+                probe = true;
+        struct randrResources *r = fetchRandrResources(probe);
+        if (!probe && snapshotAmbiguous(r)) {
+                printf("Current resources are ambiguous; probing\n");
+                freeRandrResources(r);
+                probe = true;
+                r = fetchRandrResources(probe);
+        }
+        if (probe)
+                stats.fullProbes++;
+        else
+                stats.probesAvoided++;
+        r->fingerprint = fingerprint(r);
+        r->taken = monotonicNs();
+
+        for (int i = 0; i < r->noutput; ++i)
+                printf("%s %d\n", r->outputs[i].name, r->outputs[i].connection);
+        printf("Snapshot %016llx of %d outputs and %d CRTCs took %.3f ms "
+               "(%s, %s); %lu full probes, %lu avoided\n",
+               (unsigned long long)r->fingerprint,
+               r->noutput, r->ncrtc, (monotonicNs() - start) / 1e6,
+               backend->name, probe ? "probed" : "current",
+               stats.fullProbes, stats.probesAvoided);
+        return r;
+}
+
+// Return whether a and b have the same outputs plugged in.
 bool
 randrResourcesEqual(struct randrResources *a, struct randrResources *b)
 {
-        if (a->res->noutput != b->res->noutput)
+        return a->fingerprint == b->fingerprint;
+}
+
+static void
+initLayout(struct randrResources *r, struct layout *l)
+{
+        l->n = 0;
+        l->outputs = xmalloc(r->noutput * sizeof *l->outputs);
+        l->width = l->height = 0;
+        l->primary = 0;
+}
+
+// Pick a CRTC for o that isn't in used and mark it used.  Keep the
+// output's current CRTC if it has one, so we don't move it
+// needlessly, otherwise take the first free one it can use.  Return
+// its ID, or 0 if there's none.
+static uint32_t
+pickCrtc(struct randrResources *r, struct randrOutput *o, bool *used)
+{
+        int crtc = -1;
+        for (int j = 0; j < r->ncrtc; ++j) {
+                if (used[j])
+                        continue;
+                bool possible = false;
+                for (int k = 0; k < o->ncrtc; ++k)
+                        if (o->crtcs[k] == r->crtcs[j].id)
+                                possible = true;
+                if (!possible)
+                        continue;
+                if (r->crtcs[j].id == o->crtc) {
+                        crtc = j;
+                        break;
+                }
+                if (crtc < 0)
+                        crtc = j;
+        }
+        if (crtc < 0) {
+                printf("No free CRTC for %s\n", o->name);
+                return 0;
+        }
+        used[crtc] = true;
+        return r->crtcs[crtc].id;
+}
+
+// RandR rotations, by the names xrandr gives them
+static const struct
+{
+        const char *name;
+        unsigned int rotation;
+} rotationNames[] = {
+        {"normal", RR_Rotate_0}, {"left", RR_Rotate_90},
+        {"inverted", RR_Rotate_180}, {"right", RR_Rotate_270},
+};
+
+// Return the name of rotation's rotation, ignoring any reflection.
+const char *
+rotationName(unsigned int rotation)
+{
+        for (int i = 0; i < sizeof rotationNames / sizeof *rotationNames; ++i)
+                if (rotation & rotationNames[i].rotation)
+                        return rotationNames[i].name;
+        return "normal";
+}
+
+bool
+parseRotation(const char *name, unsigned int *rotation)
+{
+        for (int i = 0; i < sizeof rotationNames / sizeof *rotationNames; ++i) {
+                if (strcmp(name, rotationNames[i].name) == 0) {
+                        *rotation = rotationNames[i].rotation;
+                        return true;
+                }
+        }
+        return false;
+}
+
+// Add o to l, driven by mode m with the given rotation at x, y.
+static bool
+addToLayout(struct randrResources *r, struct layout *l, bool *used,
+            struct randrOutput *o, struct randrMode *m,
+            unsigned int rotation, int x, int y)
+{
+        uint32_t crtc = pickCrtc(r, o, used);
+        if (!crtc)
+                return false;
+        struct randrCrtc *c = findCrtc(r, crtc);
+        if ((c->rotations & rotation) != rotation) {
+                printf("%s can't be rotated %s\n", o->name,
+                       rotationName(rotation));
+                return false;
+        }
+        unsigned int width = m->width, height = m->height;
+        if (rotation & (RR_Rotate_90 | RR_Rotate_270)) {
+                width = m->height;
+                height = m->width;
+        }
+        l->outputs[l->n++] = (struct layoutOutput){
+                o->id, crtc, m->id, rotation, x, y, width, height};
+        printf("Layout: %s %s %s at %d,%d\n", o->name, m->name,
+               rotationName(rotation), x, y);
+        if (x + width > l->width)
+                l->width = x + width;
+        if (y + height > l->height)
+                l->height = y + height;
+        return true;
+}
+
+// The built-in layout: every connected output at its preferred mode,
+// placed left to right in the order the server lists them, with the
+// first one primary.
+static void
+computeLayout(struct randrResources *r, struct layout *l)
+{
+        initLayout(r, l);
+        bool *used = xmalloc(r->ncrtc * sizeof *used);
+        memset(used, 0, r->ncrtc * sizeof *used);
+
+        for (int i = 0; i < r->noutput; ++i) {
+                struct randrOutput *o = &r->outputs[i];
+                if (o->connection != RR_Connected)
+                        continue;
+                struct randrMode *m = pickMode(r, o);
+                if (!m) {
+                        printf("%s has no usable mode\n", o->name);
+                        continue;
+                }
+                if (addToLayout(r, l, used, o, m, RR_Rotate_0, l->width,
+                                0) && !l->primary)
+                        l->primary = o->id;
+        }
+        free(used);
+}
+
+struct layoutOutput *
+layoutCrtc(struct layout *l, uint32_t crtc)
+{
+        for (int i = 0; i < l->n; ++i)
+                if (l->outputs[i].crtc == crtc)
+                        return &l->outputs[i];
+        return NULL;
+}
+
+// Return whether crtc is already driving exactly what lo says.
+bool
+crtcMatches(struct randrCrtc *c, struct layoutOutput *lo)
+{
+        return c->mode == lo->mode && c->x == lo->x && c->y == lo->y &&
+                c->rotation == lo->rotation &&
+                c->noutput == 1 && c->outputs[0] == lo->output;
+}
+
+// Profiles remember the layout last used with each fingerprint, so a
+// known set of monitors gets its layout back, including any changes
+// the user made by hand, with one lookup.  They're kept in a text
+// file:
+//
+//   profile <fingerprint>
+//   output <name> <width>x<height> <dot clock> <x> <y> [<flag>...]
+//   ...
+//
+// where the flags are rotate=<left|inverted|right>, reflect=<x|y|xy>
+// and primary.  An output without them is unrotated and unreflected.
+
+struct profileOutput
+{
+        char *name;
+        unsigned int width, height;
+        unsigned long dotClock;
+        unsigned int rotation;
+        int x, y;
+        bool primary;
+};
+
+struct profile
+{
+        uint64_t fingerprint;
+        int n;
+        struct profileOutput *outputs;
+};
+
+// The profile file, or NULL to not use profiles
+static const char *profilePath;
+static struct profile *profiles;
+static int nprofiles;
+
+static struct profile *
+findProfile(uint64_t fingerprint)
+{
+        for (int i = 0; i < nprofiles; ++i)
+                if (profiles[i].fingerprint == fingerprint)
+                        return &profiles[i];
+        return NULL;
+}
+
+static void
+freeProfile(struct profile *p)
+{
+        for (int i = 0; i < p->n; ++i)
+                free(p->outputs[i].name);
+        free(p->outputs);
+}
+
+// Parse the flags at the end of an output line into po.
+static bool
+parseProfileFlags(const char *line, struct profileOutput *po)
+{
+        po->rotation = RR_Rotate_0;
+        po->primary = false;
+        char *flags = copyName(line, strlen(line)), *save = NULL;
+        bool ok = true;
+        for (char *flag = strtok_r(flags, " \t\n", &save); ok && flag;
+             flag = strtok_r(NULL, " \t\n", &save)) {
+                unsigned int rotation;
+                if (strcmp(flag, "primary") == 0) {
+                        po->primary = true;
+                } else if (strncmp(flag, "rotate=", 7) == 0 &&
+                           parseRotation(flag + 7, &rotation)) {
+                        po->rotation = (po->rotation & ~0xf) | rotation;
+                } else if (strncmp(flag, "reflect=", 8) == 0 &&
+                           strspn(flag + 8, "xy") == strlen(flag + 8)) {
+                        if (strchr(flag + 8, 'x'))
+                                po->rotation |= RR_Reflect_X;
+                        if (strchr(flag + 8, 'y'))
+                                po->rotation |= RR_Reflect_Y;
+                } else {
+                        ok = false;
+                }
+        }
+        free(flags);
+        return ok;
+}
+
+static void
+loadProfiles(void)
+{
+        FILE *f = fopen(profilePath, "r");
+        if (!f) {
+                if (errno != ENOENT)
+                        perror(profilePath);
+                return;
+        }
+        char *line = NULL;
+        size_t cap = 0;
+        struct profile *p = NULL;
+        while (getline(&line, &cap, f) > 0) {
+                unsigned long long fp;
+                char name[64];
+                int end = 0;
+                struct profileOutput po;
+                if (sscanf(line, "profile %llx", &fp) == 1) {
+                        profiles = realloc(profiles,
+                                           (nprofiles + 1) * sizeof *profiles);
+                        if (!profiles) {
+                                fprintf(stderr, "Out of memory\n");
+                                exit(1);
+                        }
+                        p = &profiles[nprofiles++];
+                        *p = (struct profile){fp};
+                } else if (p && sscanf(line, "output %63s %ux%u %lu %d %d%n",
+                                       name, &po.width, &po.height,
+                                       &po.dotClock, &po.x, &po.y,
+                                       &end) == 6 && end &&
+                           parseProfileFlags(line + end, &po)) {
+                        po.name = copyName(name, strlen(name));
+                        p->outputs = realloc(p->outputs,
+                                             (p->n + 1) * sizeof *p->outputs);
+                        if (!p->outputs) {
+                                fprintf(stderr, "Out of memory\n");
+                                exit(1);
+                        }
+                        p->outputs[p->n++] = po;
+                } else if (line[strspn(line, " \t\n")]) {
+                        fprintf(stderr, "%s: bad line: %s", profilePath, line);
+                }
+        }
+        free(line);
+        fclose(f);
+        printf("Loaded %d profiles from %s\n", nprofiles, profilePath);
+}
+
+static void
+saveProfiles(void)
+{
+        char *tmp;
+        if (asprintf(&tmp, "%s.%d", profilePath, (int)getpid()) < 0)
+                return;
+        FILE *f = fopen(tmp, "w");
+        if (!f) {
+                perror(tmp);
+                free(tmp);
+                return;
+        }
+        for (int i = 0; i < nprofiles; ++i) {
+                struct profile *p = &profiles[i];
+                fprintf(f, "profile %016llx\n",
+                        (unsigned long long)p->fingerprint);
+                for (int j = 0; j < p->n; ++j) {
+                        struct profileOutput *po = &p->outputs[j];
+                        fprintf(f, "output %s %ux%u %lu %d %d",
+                                po->name, po->width, po->height, po->dotClock,
+                                po->x, po->y);
+                        if (!(po->rotation & RR_Rotate_0))
+                                fprintf(f, " rotate=%s",
+                                        rotationName(po->rotation));
+                        if (po->rotation & (RR_Reflect_X | RR_Reflect_Y))
+                                fprintf(f, " reflect=%s%s",
+                                        po->rotation & RR_Reflect_X ? "x" : "",
+                                        po->rotation & RR_Reflect_Y ? "y" : "");
+                        fprintf(f, "%s\n", po->primary ? " primary" : "");
+                }
+        }
+        if (fclose(f) != 0 || rename(tmp, profilePath) != 0) {
+                perror(profilePath);
+                unlink(tmp);
+        }
+        free(tmp);
+}
+
+static bool
+profilesEqual(struct profile *a, struct profile *b)
+{
+        if (a->n != b->n)
                 return false;
-        for (int i = 0; i < a->res->noutput; ++i) {
-                XRROutputInfo *ao = a->outputs[i], *bo = b->outputs[i];
-                if (strcmp(ao->name, bo->name) ||
-                    ao->nmode != bo->nmode ||
-                    ao->npreferred != bo->npreferred ||
-                    memcmp(ao->modes, bo->modes,
-                           sizeof(*ao->modes) * ao->nmode))
+        for (int i = 0; i < a->n; ++i) {
+                struct profileOutput *x = &a->outputs[i], *y = &b->outputs[i];
+                if (strcmp(x->name, y->name) || x->width != y->width ||
+                    x->height != y->height || x->dotClock != y->dotClock ||
+                    x->rotation != y->rotation || x->x != y->x ||
+                    x->y != y->y || x->primary != y->primary)
                         return false;
         }
         return true;
 }
 
-void
-freeRandrResources(struct randrResources *r)
+// Fold one CRTC's configuration into a crtcHash.
+static uint64_t
+hashCrtc(uint64_t h, uint32_t id, uint32_t mode, int x, int y,
+         unsigned int rotation, int noutput, const uint32_t *outputs)
 {
-        for (int i = 0; i < r->res->noutput; ++i)
-                XRRFreeOutputInfo(r->outputs[i]);
-        free(r->outputs);
-        XRRFreeScreenResources(r->res);
-        free(r);
+        h = fnv1a(h, &id, sizeof id);
+        if (!mode)
+                return h;
+        int pos[] = {x, y};
+        h = fnv1a(h, &mode, sizeof mode);
+        h = fnv1a(h, pos, sizeof pos);
+        h = fnv1a(h, &rotation, sizeof rotation);
+        return fnv1a(h, outputs, noutput * sizeof *outputs);
 }
 
+// Hash how r's CRTCs and primary output are set up or, if l isn't
+// NULL, how they will be once l is applied to r.
+static uint64_t
+crtcHash(struct randrResources *r, struct layout *l)
+{
+        uint64_t h = 0xcbf29ce484222325ull;
+        for (int i = 0; i < r->ncrtc; ++i) {
+                struct randrCrtc *c = &r->crtcs[i];
+                struct layoutOutput *lo = l ? layoutCrtc(l, c->id) : NULL;
+                if (lo)
+                        h = hashCrtc(h, c->id, lo->mode, lo->x, lo->y,
+                                     lo->rotation, 1, &lo->output);
+                else if (l)
+                        h = hashCrtc(h, c->id, 0, 0, 0, 0, 0, NULL);
+                else
+                        h = hashCrtc(h, c->id, c->mode, c->x, c->y,
+                                     c->rotation, c->noutput, c->outputs);
+        }
+        uint32_t primary = l && l->primary ? l->primary : r->primary;
+        return fnv1a(h, &primary, sizeof primary);
+}
+
+// The crtcHash of the layout we or reconfigCommand last set up.
+// Layout changes that end there are our own doing, not the user's.
+static uint64_t ownLayout;
+
+// Note that whatever the screen is doing now is our own doing.
+static void
+noteOwnLayout(void)
+{
+        struct randrResources *r = fetchRandrResources(false);
+        ownLayout = crtcHash(r, NULL);
+        freeRandrResources(r);
+}
+
+// Save the layout r is currently using as the profile for its
+// fingerprint.
+static void
+rememberLayout(struct randrResources *r)
+{
+        // Each output is on at most one CRTC, but a CRTC can drive
+        // several (mirrored) outputs.  Record each of them.
+        struct profile np = {r->fingerprint, 0,
+                             xmalloc(r->noutput * sizeof *np.outputs)};
+        for (int i = 0; i < r->ncrtc; ++i) {
+                struct randrCrtc *c = &r->crtcs[i];
+                struct randrMode *m = findMode(r, c->mode);
+                if (!m)
+                        continue;
+                for (int j = 0; j < r->noutput; ++j) {
+                        struct randrOutput *o = &r->outputs[j];
+                        bool on = false;
+                        for (int k = 0; k < c->noutput; ++k)
+                                if (c->outputs[k] == o->id)
+                                        on = true;
+                        if (!on || np.n == r->noutput)
+                                continue;
+                        np.outputs[np.n++] = (struct profileOutput){
+                                copyName(o->name, strlen(o->name)),
+                                m->width, m->height, m->dotClock,
+                                c->rotation, c->x, c->y, o->id == r->primary};
+                }
+        }
+
+        struct profile *p = findProfile(r->fingerprint);
+        if (p && profilesEqual(p, &np)) {
+                freeProfile(&np);
+                return;
+        }
+        if (p) {
+                freeProfile(p);
+        } else {
+                profiles = realloc(profiles,
+                                   (nprofiles + 1) * sizeof *profiles);
+                if (!profiles) {
+                        fprintf(stderr, "Out of memory\n");
+                        exit(1);
+                }
+                p = &profiles[nprofiles++];
+        }
+        *p = np;
+        printf("Saved profile %016llx with %d outputs\n",
+               (unsigned long long)np.fingerprint, np.n);
+        saveProfiles();
+}
+
+// Turn profile p back into a layout for r.  Fail if any of its
+// outputs or modes are missing.
+static bool
+layoutFromProfile(struct randrResources *r, struct profile *p,
+                  struct layout *l)
+{
+        initLayout(r, l);
+        bool *used = xmalloc(r->ncrtc * sizeof *used);
+        memset(used, 0, r->ncrtc * sizeof *used);
+        bool ok = true;
+        for (int i = 0; ok && i < p->n; ++i) {
+                struct profileOutput *po = &p->outputs[i];
+                struct randrOutput *o = NULL;
+                for (int j = 0; j < r->noutput; ++j)
+                        if (strcmp(r->outputs[j].name, po->name) == 0)
+                                o = &r->outputs[j];
+                struct randrMode *m = NULL;
+                for (int j = 0; o && !m && j < o->nmode; ++j) {
+                        struct randrMode *c = findMode(r, o->modes[j]);
+                        if (c && c->width == po->width &&
+                            c->height == po->height &&
+                            c->dotClock == po->dotClock)
+                                m = c;
+                }
+                ok = m && addToLayout(r, l, used, o, m, po->rotation,
+                                      po->x, po->y);
+                if (ok && po->primary)
+                        l->primary = o->id;
+        }
+        free(used);
+        if (!ok) {
+                printf("Profile %016llx doesn't fit; ignoring it\n",
+                       (unsigned long long)p->fingerprint);
+                free(l->outputs);
+        }
+        return ok;
+}
+
+// Event sources, as tagged in the epoll set
+enum source
+{
+        SOURCE_BACKEND,
+        SOURCE_UDEV,
+        SOURCE_CLOCK,
+        SOURCE_COMMAND,
+        SOURCE_STATUS,
+        SOURCE_CLIENT,
+};
+
+static int epfd;
+
+// Watch fd for input.  The event's data holds the source in the low
+// 32 bits and fd in the high 32.
+static void
+addSource(int fd, enum source source)
+{
+        struct epoll_event ev = {
+                .events = EPOLLIN,
+                .data.u64 = (uint64_t)fd << 32 | source,
+        };
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+                perror("epoll_ctl");
+                exit(1);
+        }
+}
+
+// The running reconfigCommand, if any.  It runs in its own process
+// group so we can kill whatever it starts, too.
+static pid_t commandPid;
+static int commandFd = -1;
+static uint64_t commandStart, commandChangeStart;
+// The last signal we sent it, or 0
+static int commandSignal;
+// Whether the topology changed since it started, so it needs to run
+// again once it exits
+static bool reconfigPending;
+
+// Note that the screen is configured for the change that started at
+// eventStart.
+static void
+configured(uint64_t eventStart)
+{
+        uint64_t ns = monotonicNs() - eventStart;
+        double ms = ns / 1e6;
+        printf("Configured %.1f ms after the first event\n", ms);
+        histAdd(&stats.configured, ns);
+        if (backend->done) {
+                if (nlatencies == latenciesCap) {
+                        latenciesCap = latenciesCap ? 2 * latenciesCap : 64;
+                        latencies = realloc(latencies,
+                                            latenciesCap * sizeof *latencies);
+                        if (!latencies) {
+                                fprintf(stderr, "Out of memory\n");
+                                exit(1);
+                        }
+                }
+                latencies[nlatencies++] = ms;
+        }
+        if (ms <= latencyBudgetMs) {
+                stats.reconfigsInBudget++;
+        } else {
+                stats.reconfigsOverBudget++;
+                printf("Over the %d ms latency budget "
+                       "(%lu of %lu reconfigurations)\n", latencyBudgetMs,
+                       stats.reconfigsOverBudget,
+                       stats.reconfigsOverBudget + stats.reconfigsInBudget);
+        }
+}
+
+static void
+startCommand(void)
+{
+        extern char **environ;
+        char *argv[] = {"/bin/sh", "-c", (char*)reconfigCommand, NULL};
+        posix_spawnattr_t attr;
+        posix_spawnattr_init(&attr);
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+        posix_spawnattr_setpgroup(&attr, 0);
+        int err = posix_spawn(&commandPid, argv[0], NULL, &attr, argv,
+                              environ);
+        posix_spawnattr_destroy(&attr);
+        if (err) {
+                fprintf(stderr, "Failed to run %s: %s\n", reconfigCommand,
+                        strerror(err));
+                commandPid = 0;
+                return;
+        }
+        stats.commandRuns++;
+        commandStart = monotonicNs();
+        commandChangeStart = changeStart;
+        commandSignal = 0;
+        printf("Running %s (pid %d)\n", reconfigCommand, (int)commandPid);
+
+        commandFd = syscall(SYS_pidfd_open, commandPid, 0);
+        if (commandFd < 0) {
+                // Pre-5.3 kernel.  Just wait for it, like system would.
+                int status;
+                waitpid(commandPid, &status, 0);
+                commandPid = 0;
+                noteOwnLayout();
+                configured(commandChangeStart);
+                return;
+        }
+        addSource(commandFd, SOURCE_COMMAND);
+}
+
+static void
+killCommand(int sig)
+{
+        kill(-commandPid, sig);
+        if (!commandSignal)
+                stats.reconfigsAbandoned++;
+        commandSignal = sig;
+}
+
+// Reap reconfigCommand if it exited.
+static void
+handleCommand(void)
+{
+        int status;
+        if (waitpid(commandPid, &status, WNOHANG) <= 0)
+                return;
+        epoll_ctl(epfd, EPOLL_CTL_DEL, commandFd, NULL);
+        close(commandFd);
+        commandFd = -1;
+        commandPid = 0;
+        uint64_t ns = monotonicNs() - commandStart;
+        printf("%s %s after %.1f ms\n", reconfigCommand,
+               commandSignal ? "stopped" : "finished", ns / 1e6);
+        if (!commandSignal)
+                histAdd(&stats.command, ns);
+        if (WIFEXITED(status) && WEXITSTATUS(status)) {
+                printf("%s exited with status %d\n", reconfigCommand,
+                       WEXITSTATUS(status));
+                stats.commandFailures++;
+        }
+        if (!commandSignal && !reconfigPending) {
+                noteOwnLayout();
+                configured(commandChangeStart);
+        }
+}
+
+// Return how long we can wait for events, in milliseconds, before
+// reconfigCommand times out.  Timeout bounds the result.  A command
+// that ignores being superseded gets the same deadline.
+static int
+commandWait(int timeout)
+{
+        if (!commandPid || commandSignal == SIGKILL)
+                return timeout;
+        int64_t left = (int64_t)(commandStart - monotonicNs()) / 1000000 +
+                reconfigTimeoutMs;
+        if (left < 0)
+                left = 0;
+        // Round up, so we don't wake up just before the deadline
+        left++;
+        return timeout < 0 || left < timeout ? left : timeout;
+}
+
+static void
+checkCommandTimeout(void)
+{
+        if (commandPid && commandSignal != SIGKILL &&
+            monotonicNs() - commandStart >= reconfigTimeoutMs * 1000000ull) {
+                printf("%s timed out after %d ms; killing it\n",
+                       reconfigCommand, reconfigTimeoutMs);
+                stats.commandTimeouts++;
+                killCommand(SIGKILL);
+        }
+}
+
+// Lay out r: as its profile says if there is one, otherwise with
+// reconfigCommand or the built-in layout.  If reconfigCommand is still
+// working on an older topology, stop it first; the latest snapshot is
+// then laid out once it exits.
+static void
+reconfigure(struct randrResources *r)
+{
+        if (commandPid) {
+                printf("Superseding %s (pid %d)\n", reconfigCommand,
+                       (int)commandPid);
+                if (!commandSignal)
+                        killCommand(SIGTERM);
+                reconfigPending = true;
+                return;
+        }
+        reconfigPending = false;
+
+        uint64_t start = monotonicNs();
+        struct layout l;
+        struct profile *p = findProfile(r->fingerprint);
+        if (p && layoutFromProfile(r, p, &l)) {
+                printf("Using profile %016llx\n",
+                       (unsigned long long)p->fingerprint);
+                stats.profilesUsed++;
+        } else if (reconfigCommand) {
+                startCommand();
+                return;
+        } else {
+                computeLayout(r, &l);
+        }
+        if (backend->apply(r, &l)) {
+                uint64_t ns = monotonicNs() - start;
+                printf("Applied layout in %.3f ms\n", ns / 1e6);
+                histAdd(&stats.apply, ns);
+                ownLayout = crtcHash(r, &l);
+                configured(changeStart);
+        } else {
+                // It may have gotten partway
+                noteOwnLayout();
+        }
+        free(l.outputs);
+}
+
+// The most recent snapshot
+static struct randrResources *current;
+
+// Take a snapshot and reconfigure if what's plugged in changed.  If
+// probe is set, make the server re-probe the hardware.
 void
-handleChange(void)
+handleChange(bool probe)
 {
-        static struct randrResources *prev = NULL;
-        struct randrResources *now = getRandrResources();
-        if (!prev || !randrResourcesEqual(prev, now)) {
+        // Probe once at startup, since nothing may have asked the
+        // server to yet.  After that, events tell us about changes.
+        struct randrResources *now = getRandrResources(probe || !current);
+        if (!current || !randrResourcesEqual(current, now)) {
                 printf("Resources differ\n");
-                system("xauto");
+                if (current)
+                        stats.topologyChanges++;
+                reconfigure(now);
         } else
                 printf("Resources do not differ\n");
-        if (prev)
-                freeRandrResources(prev);
-        prev = now;
+        if (current)
+                freeRandrResources(current);
+        current = now;
 }
 
-int
-main(int argc, char **argv)
+// The layout changed, either because we or a command applied one or
+// because the user rearranged things.  If nothing was plugged or
+// unplugged and it was the user, remember it for these outputs.
+// Remembering our own layouts, or reconfigCommand's, would pin the
+// first automatic layout for each set of outputs for good.  So would
+// remembering what a superseded command left behind before we lay
+// things out again.
+void
+handleLayoutChange(void)
 {
-        int rrEvent, rrError;
-        int r;
+        struct randrResources *now = getRandrResources(false);
+        if (current && randrResourcesEqual(current, now)) {
+                if (!commandPid && !reconfigPending &&
+                    crtcHash(now, NULL) != ownLayout)
+                        rememberLayout(now);
+                freeRandrResources(current);
+                current = now;
+        } else {
+                freeRandrResources(now);
+                handleChange(false);
+        }
+}
 
-        // Open the X display and check for Xrandr
-        dpy = XOpenDisplay(NULL);
-        if (!dpy) {
-                fprintf(stderr, "Can't open display %s\n", XDisplayName(NULL));
-                exit(1);
+static struct udev_monitor *udevMonitor;
+static int statusFd = -1;
+static int clockFd = -1;
+// CLOCK_BOOTTIME minus CLOCK_MONOTONIC when we last looked.  This
+// grows by the time spent suspended.
+static int64_t suspendOffset;
+
+static void
+raiseChange(enum change *change, enum change c)
+{
+        if (c > *change)
+                *change = c;
+}
+
+static int
+drainUdev(enum change *change)
+{
+        int n = 0;
+        struct udev_device *dev;
+        while ((dev = udev_monitor_receive_device(udevMonitor))) {
+                const char *action = udev_device_get_action(dev);
+                const char *hotplug =
+                        udev_device_get_property_value(dev, "HOTPLUG");
+                printf("udev: %s %s%s\n", action ? action : "?",
+                       udev_device_get_sysname(dev),
+                       hotplug ? " (hotplug)" : "");
+                // Connector changes arrive as "change" events with
+                // HOTPLUG=1.  A whole card can come and go, too (say,
+                // a USB display adapter).
+                if (action && (strcmp(action, "add") == 0 ||
+                               strcmp(action, "remove") == 0 ||
+                               (hotplug && strcmp(hotplug, "1") == 0)))
+                        raiseChange(change, CHANGE_PROBE);
+                udev_device_unref(dev);
+                n++;
         }
-        root = RootWindow(dpy, DefaultScreen(dpy));
-        int major, minor;
-        if (!XRRQueryVersion (dpy, &major, &minor)) {
-                fprintf(stderr, "RandR extension missing\n");
+        stats.udevEvents += n;
+        return n;
+}
+
+static int64_t
+getSuspendOffset(void)
+{
+        struct timespec boot, mono;
+        clock_gettime(CLOCK_BOOTTIME, &boot);
+        clock_gettime(CLOCK_MONOTONIC, &mono);
+        return (boot.tv_sec - mono.tv_sec) * 1000000000ll +
+                boot.tv_nsec - mono.tv_nsec;
+}
+
+// Arm the clock timer for the distant future.  It only exists to be
+// cancelled.
+static void
+armClock(void)
+{
+        struct itimerspec its = {};
+        clock_gettime(CLOCK_REALTIME, &its.it_value);
+        its.it_value.tv_sec += 365 * 24 * 60 * 60;
+        if (timerfd_settime(clockFd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET,
+                            &its, NULL) < 0) {
+                perror("timerfd_settime");
                 exit(1);
         }
-        if (major < 0 || (major == 1 && minor < 2)) {
-                fprintf(stderr, "Requires RandR >= 1.2\n");
-                exit(1);
+        suspendOffset = getSuspendOffset();
+}
+
+// A resume calls for a probe, but neither it nor a wall clock change
+// is an event from the hardware, so they don't count toward bursts.
+static void
+handleClock(enum change *change)
+{
+        uint64_t expirations;
+        if (read(clockFd, &expirations, sizeof expirations) >= 0 ||
+            errno != ECANCELED)
+                return;
+        int64_t slept = getSuspendOffset() - suspendOffset;
+        if (slept > 1000000000ll) {
+                printf("Resumed after %.1f s suspended\n", slept / 1e9);
+                stats.resumes++;
+                raiseChange(change, CHANGE_PROBE);
+        } else {
+                printf("Wall clock changed\n");
         }
+        armClock();
+}
 
-        // Get Xrandr event base
-        if (!XRRQueryExtension(dpy, &rrEvent, &rrError)) {
-                fprintf(stderr, "Failed to query RandR extension\n");
+static void
+setupSources(void)
+{
+        epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (epfd < 0) {
+                perror("epoll_create1");
                 exit(1);
         }
+        addSource(backend->fd, SOURCE_BACKEND);
+        if (statusPath && (statusFd = statusListen(statusPath)) >= 0)
+                addSource(statusFd, SOURCE_STATUS);
+        if (backend->done)
+                // Replaying a script.  Don't let the real hardware
+                // get mixed in.
+                return;
 
-        // Assume things are initially configured incorrectly
-        handleChange();
+        // udev and the clock are best-effort.  Without them we just
+        // miss what the X server misses.
+        struct udev *udev = udev_new();
+        if (udev)
+                udevMonitor = udev_monitor_new_from_netlink(udev, "udev");
+        if (udevMonitor &&
+            udev_monitor_filter_add_match_subsystem_devtype(
+                    udevMonitor, "drm", NULL) >= 0 &&
+            udev_monitor_enable_receiving(udevMonitor) >= 0)
+                addSource(udev_monitor_get_fd(udevMonitor), SOURCE_UDEV);
+        else
+                fprintf(stderr, "Failed to monitor udev; "
+                        "relying on the X server for hotplug\n");
 
-        // Monitor xrandr events on the root window
-        XRRSelectInput(dpy, root, RROutputChangeNotifyMask);
+        clockFd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (clockFd >= 0) {
+                armClock();
+                addSource(clockFd, SOURCE_CLOCK);
+        } else {
+                perror("timerfd_create; won't notice resume");
+        }
+}
 
-        // Handle events
-        while (1) {
-                XEvent ev;
-                XNextEvent(dpy, &ev);
-                if (ev.type == rrEvent + RRNotify_OutputChange) {
-                        handleChange();
-                } else {
-                        printf("Unexpected X event: %d\n", ev.type);
+static int
+drainBackend(enum change *change)
+{
+        enum change c = CHANGE_NONE;
+        int n = backend->drain(&c);
+        stats.backendEvents += n;
+        // Layout changes are only interesting if there's a profile
+        // to update
+        if (c == CHANGE_LAYOUT && !profilePath)
+                c = CHANGE_NONE;
+        raiseChange(change, c);
+        return n;
+}
+
+// Answer status clients that are ready.
+static void
+handleStatus(struct epoll_event *ev)
+{
+        int fd = ev->data.u64 >> 32;
+        if ((uint32_t)ev->data.u64 == SOURCE_STATUS) {
+                while ((fd = statusAccept(statusFd)) >= 0)
+                        addSource(fd, SOURCE_CLIENT);
+        } else if (statusServe(fd, current)) {
+                epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+                close(fd);
+        }
+}
+
+// Drop status clients that have taken too long to ask.
+static void
+expireStatus(void)
+{
+        int fd;
+        while ((fd = statusExpired()) >= 0) {
+                epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+                close(fd);
+        }
+}
+
+// Wait up to timeout milliseconds (or forever if negative) for
+// events from any source and handle them.  Return the number handled
+// and raise *change to the most any of them called for.  Status
+// requests are answered along the way, but aren't events, so they
+// don't cut the wait short.  The clock and reconfigCommand exiting
+// do end the wait, so the caller can act on them, but they aren't
+// events either.
+static int
+pollEvents(int timeout, enum change *change)
+{
+        // Xlib may have already read events off the socket
+        int n = drainBackend(change);
+        if (n)
+                return n;
+
+        uint64_t deadline = monotonicNs() + timeout * 1000000ull;
+        int nev;
+        struct epoll_event evs[16];
+        do {
+                int left = timeout;
+                if (timeout > 0) {
+                        int64_t ns = deadline - monotonicNs();
+                        left = ns > 0 ? (ns + 999999) / 1000000 : 0;
+                }
+                int wait = commandWait(left);
+                int statusLeft = statusWait(wait);
+                nev = epoll_wait(epfd, evs, 16, statusLeft);
+                if (nev < 0 && errno != EINTR) {
+                        perror("epoll_wait");
+                        exit(1);
+                }
+                // A status client's deadline isn't an event either
+                if (nev == 0 && statusLeft != wait)
+                        nev = -1;
+                int busy = 0;
+                for (int i = 0; i < nev; ++i) {
+                        uint32_t source = evs[i].data.u64;
+                        if (source == SOURCE_STATUS ||
+                            source == SOURCE_CLIENT) {
+                                handleStatus(&evs[i]);
+                                busy++;
+                        }
+                }
+                expireStatus();
+                // Go back to waiting if that was all
+                if (nev > 0 && nev == busy)
+                        nev = -1;
+        } while (nev < 0 && (timeout < 0 || monotonicNs() < deadline));
+
+        for (int i = 0; i < nev; ++i) {
+                switch ((uint32_t)evs[i].data.u64) {
+                case SOURCE_BACKEND:
+                        n += drainBackend(change);
+                        break;
+                case SOURCE_UDEV:
+                        n += drainUdev(change);
+                        break;
+                case SOURCE_CLOCK:
+                        handleClock(change);
+                        break;
+                case SOURCE_COMMAND:
+                        handleCommand();
+                        break;
+                }
+        }
+        checkCommandTimeout();
+        return n;
+}
+
+// Return whether the backend has run dry and there's nothing left to
+// do.  The X server never does.
+static bool
+finished(void)
+{
+        return backend->done && backend->done() && !commandPid &&
+                !reconfigPending;
+}
+
+static int
+compareDouble(const void *a, const void *b)
+{
+        double x = *(const double*)a, y = *(const double*)b;
+        return x < y ? -1 : x > y;
+}
+
+static double
+percentile(double p)
+{
+        if (nlatencies == 0)
+                return 0;
+        return latencies[(int)(p * (nlatencies - 1) + 0.5)];
+}
+
+// Summarize a replay on one line, in the same key=value form as
+// FLING_STATS, for bench.sh.
+static void
+report(void)
+{
+        qsort(latencies, nlatencies, sizeof *latencies, compareDouble);
+        printf("xrandrd-stats events=%lu merged=%lu snapshots=%lu "
+               "probes=%lu reconfigs=%lu abandoned=%lu over_budget=%lu "
+               "lat_min=%.3f lat_p50=%.3f lat_p90=%.3f lat_p99=%.3f "
+               "lat_max=%.3f\n",
+               stats.events, stats.eventsMerged,
+               stats.fullProbes + stats.probesAvoided, stats.fullProbes,
+               stats.reconfigsInBudget + stats.reconfigsOverBudget,
+               stats.reconfigsAbandoned, stats.reconfigsOverBudget,
+               percentile(0), percentile(0.5), percentile(0.9),
+               percentile(0.99), percentile(1));
+}
+
+// Return ~/.config/xrandrd/profiles (or under $XDG_CONFIG_HOME),
+// creating its directory if necessary.
+static const char *
+defaultProfilePath(void)
+{
+        const char *config = getenv("XDG_CONFIG_HOME"), *home = getenv("HOME");
+        char *dir, *path;
+        if (config && *config)
+                dir = copyName(config, strlen(config));
+        else if (!home || asprintf(&dir, "%s/.config", home) < 0)
+                return NULL;
+        if (asprintf(&path, "%s/xrandrd", dir) < 0) {
+                free(dir);
+                return NULL;
+        }
+        mkdir(dir, 0777);
+        if (mkdir(path, 0777) < 0 && errno != EEXIST) {
+                perror(path);
+                free(path);
+                free(dir);
+                return NULL;
+        }
+        free(path);
+        if (asprintf(&path, "%s/xrandrd/profiles", dir) < 0)
+                path = NULL;
+        free(dir);
+        return path;
+}
+
+static void
+usage(const char *argv0)
+{
+        fprintf(stderr, "Usage: %s [-X] [-S script] [-q ms] [-e command] [-t ms]\n"
+                "          [-b ms] [-p file] [-s socket]\n\n"
+                "  -X  take snapshots with Xlib instead of XCB\n"
+                "  -S  replay script against a simulated X server instead\n"
+                "      of using the real one, then report and exit\n"
+                "  -q  wait for this long without RandR events before\n"
+                "      acting on a burst of them (default %d)\n"
+                "  -e  run command (say, xauto) to reconfigure the screen\n"
+                "      instead of using the built-in layout\n"
+                "  -t  kill command if it takes longer than this\n"
+                "      (default %d)\n"
+                "  -b  report changes that take longer than this to\n"
+                "      configure (default %d)\n"
+                "  -p  keep layout profiles in file (default\n"
+                "      ~/.config/xrandrd/profiles, or none with -S); empty\n"
+                "      to not use them\n"
+                "  -s  answer status requests (stats, snapshot or json)\n"
+                "      on a Unix socket at this path\n",
+                argv0, quietMs, reconfigTimeoutMs, latencyBudgetMs);
+        exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+        int opt;
+        bool usePath = false, useXlib = false;
+        const char *script = NULL;
+
+        while ((opt = getopt(argc, argv, "XS:q:e:t:b:p:s:")) != -1) {
+                switch (opt) {
+                case 'X':
+                        useXlib = true;
+                        break;
+                case 'S':
+                        script = optarg;
+                        break;
+                case 'q':
+                        quietMs = atoi(optarg);
+                        if (quietMs < 0)
+                                usage(argv[0]);
+                        break;
+                case 'e':
+                        reconfigCommand = optarg;
+                        break;
+                case 't':
+                        reconfigTimeoutMs = atoi(optarg);
+                        if (reconfigTimeoutMs <= 0)
+                                usage(argv[0]);
+                        break;
+                case 'b':
+                        latencyBudgetMs = atoi(optarg);
+                        if (latencyBudgetMs < 0)
+                                usage(argv[0]);
+                        break;
+                case 'p':
+                        profilePath = *optarg ? optarg : NULL;
+                        usePath = true;
+                        break;
+                case 's':
+                        statusPath = optarg;
+                        break;
+                default:
+                        usage(argv[0]);
+                }
+        }
+
+        if (!usePath && !script)
+                profilePath = defaultProfilePath();
+        if (profilePath)
+                loadProfiles();
+
+        backend = script ? simOpen(script) : xOpen(useXlib);
+        setupSources();
+
+        // Assume things are initially configured incorrectly
+        changeStart = monotonicNs();
+        handleChange(true);
+
+        // Handle events in bursts, taking one snapshot once things
+        // have been quiet for quietMs.  Snapshots keep going while
+        // reconfigCommand runs; if one finds a new topology, the
+        // command is stopped and run again for the latest snapshot.
+        while (!finished()) {
+                enum change change = CHANGE_NONE;
+                int n = pollEvents(-1, &change);
+                // The burst lasts until quietMs pass without an
+                // event.  Waking up for anything else doesn't restart
+                // the quiet period.
+                uint64_t start = monotonicNs(), last = start;
+                while ((n || change != CHANGE_NONE) &&
+                       monotonicNs() - start < MAX_BURST_MS * 1000000ull) {
+                        int64_t left = (int64_t)(last - monotonicNs()) /
+                                1000000 + quietMs;
+                        if (left <= 0)
+                                break;
+                        int more = pollEvents(left, &change);
+                        if (more) {
+                                n += more;
+                                last = monotonicNs();
+                        }
+                }
+                stats.events += n;
+                if (n)
+                        stats.bursts++;
+                if (change != CHANGE_NONE) {
+                        if (n)
+                                stats.eventsMerged += n - 1;
+                        printf("Burst of %d events (%lu merged so far)\n",
+                               n, stats.eventsMerged);
+                        changeStart = start;
+                        if (change >= CHANGE_TOPOLOGY)
+                                handleChange(change == CHANGE_PROBE);
+                        else
+                                handleLayoutChange();
                 }
+                if (reconfigPending && !commandPid)
+                        reconfigure(current);
         }
 
-        XCloseDisplay(dpy);
+        report();
+        if (statusFd >= 0)
+                unlink(statusPath);
+        return 0;
 }
@@ -0,0 +1,221 @@
+// Shared between the xrandrd daemon and its display backends.
+
+#ifndef XRANDRD_H
+#define XRANDRD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <X11/extensions/randr.h>
+
+// A snapshot of the RandR configuration.  This is independent of
+// which backend it came from.
+
+struct randrMode
+{
+        uint32_t id;
+        unsigned int width, height;
+        unsigned long dotClock;
+        unsigned int hTotal, vTotal;
+        unsigned long flags;
+        char *name;
+};
+
+struct randrOutput
+{
+        uint32_t id;
+        char *name;
+        int connection;
+        uint32_t crtc;
+        unsigned long mmWidth, mmHeight;
+        int ncrtc, nmode, npreferred;
+        uint32_t *crtcs, *modes;
+        // The EDID property, if the output has one
+        unsigned char *edid;
+        int edidLen;
+};
+
+struct randrCrtc
+{
+        uint32_t id;
+        int x, y;
+        unsigned int width, height;
+        uint32_t mode;
+        unsigned int rotation, rotations;
+        int noutput, npossible;
+        uint32_t *outputs, *possible;
+};
+
+struct randrResources
+{
+        uint32_t timestamp, configTimestamp;
+        int nmode, noutput, ncrtc;
+        struct randrMode *modes;
+        struct randrOutput *outputs;
+        struct randrCrtc *crtcs;
+        // The primary output, or 0
+        uint32_t primary;
+        // See fingerprint
+        uint64_t fingerprint;
+        // monotonicNs when the snapshot was taken
+        uint64_t taken;
+};
+
+// A layout says which CRTC drives each enabled output, with what
+// mode, rotation and reflection, and where.  width and height are
+// what it covers on the screen, so they're swapped from the mode's
+// when it's turned sideways.  All other CRTCs are turned off.
+
+struct layoutOutput
+{
+        uint32_t output, crtc, mode;
+        unsigned int rotation;
+        int x, y;
+        unsigned int width, height;
+};
+
+struct layout
+{
+        int n;
+        struct layoutOutput *outputs;
+        unsigned int width, height;
+        uint32_t primary;
+};
+
+// What a burst of events calls for, in increasing order
+enum change
+{
+        CHANGE_NONE,
+        // The layout may have changed
+        CHANGE_LAYOUT,
+        // The connected outputs may have changed
+        CHANGE_TOPOLOGY,
+        // The hardware may have changed without the server noticing
+        CHANGE_PROBE,
+};
+
+
+// A backend is where snapshots come from, where layouts go and where
+// events come from: an X server, or a simulator that replays a script.
+struct backend
+{
+        // For log messages
+        const char *name;
+        // Whether fetch can take a snapshot without making the server
+        // probe every connector
+        bool cheapSnapshots;
+        // Readable when there may be events to drain
+        int fd;
+        // Return a snapshot, or NULL on failure.  If probe is set,
+        // make the server re-probe the hardware first.  The
+        // fingerprint is left for the caller.
+        struct randrResources *(*fetch)(bool probe);
+        // Configure the screen as l says.  Return whether it worked.
+        bool (*apply)(struct randrResources *r, struct layout *l);
+        // Handle every event that's already arrived.  Return the
+        // number handled and raise *change to the most any of them
+        // called for.
+        int (*drain)(enum change *change);
+        // If not NULL, return whether there will never be another
+        // event.
+        bool (*done)(void);
+};
+
+// Connect to the X server named by $DISPLAY.  If useXlib is set, take
+// snapshots through Xlib instead of XCB.
+struct backend *xOpen(bool useXlib);
+
+// Replay the script in path.
+struct backend *simOpen(const char *path);
+
+// A latency histogram with buckets bounded 1, 2, 5, 10, 20, 50 ...
+// microseconds, up to 50 seconds, plus one for anything longer.
+#define HIST_BUCKETS 24
+
+struct histogram
+{
+        unsigned long count;
+        uint64_t sumNs, maxNs;
+        unsigned long buckets[HIST_BUCKETS + 1];
+};
+
+// The upper bound of bucket i, in microseconds
+uint64_t histBound(int i);
+void histAdd(struct histogram *h, uint64_t ns);
+// Return an upper bound on the p'th quantile, in microseconds
+uint64_t histQuantile(struct histogram *h, double p);
+
+// What the daemon has been up to, for the status socket
+struct stats
+{
+        // Events from every source and from each kind of source, the
+        // bursts they came in, and events folded into another
+        // event's snapshot
+        unsigned long events, backendEvents, udevEvents, resumes;
+        unsigned long bursts, eventsMerged;
+        // Snapshots that made the server probe every connector, and
+        // snapshots that got away without it
+        unsigned long fullProbes, probesAvoided;
+        // Snapshots that found something plugged or unplugged
+        unsigned long topologyChanges;
+        // Reconfigurations that finished within the latency budget,
+        // that didn't, and that a newer change superseded or the
+        // timeout killed
+        unsigned long reconfigsInBudget, reconfigsOverBudget,
+                reconfigsAbandoned;
+        // Layouts that came from a profile
+        unsigned long profilesUsed;
+        // Runs of the reconfigure command, those killed for taking
+        // too long, and those that exited with an error
+        unsigned long commandRuns, commandTimeouts, commandFailures;
+        // Status requests served
+        unsigned long statusRequests;
+
+        // Time to fetch a snapshot from the server, with and without
+        // a probe
+        struct histogram fetchProbed, fetchCurrent;
+        // Time to apply a layout, and to run the reconfigure command
+        struct histogram apply, command;
+        // Time from the first event of a change to being configured
+        struct histogram configured;
+};
+
+extern struct stats stats;
+
+// The status socket, in status.c.  A client connects, sends one of
+// "stats", "snapshot" or "json" on a line, and reads the answer until
+// the daemon closes the connection.  A client that doesn't finish its
+// request within STATUS_TIMEOUT_MS is dropped.
+
+#define STATUS_TIMEOUT_MS 1000
+
+// Listen on path.  Return the listening socket, or -1.
+int statusListen(const char *path);
+// Accept a client.  Return its socket, or -1.
+int statusAccept(int listenFd);
+// Read what the client on fd has sent and, once its request is
+// complete, answer it about current, which may be NULL.  Return
+// whether it's done with, in which case close fd.
+bool statusServe(int fd, struct randrResources *current);
+// Return how long we can wait, in milliseconds, before a client's
+// time is up.  Timeout bounds the result.
+int statusWait(int timeout);
+// Forget a client whose time is up and return its socket to close,
+// or return -1 if there's none.
+int statusExpired(void);
+
+// Helpers from xrandrd.c
+
+void *xmalloc(size_t size);
+uint32_t *copyIds(const uint32_t *ids, int n);
+char *copyName(const void *name, int len);
+uint64_t monotonicNs(void);
+struct randrMode *findMode(struct randrResources *r, uint32_t id);
+struct randrCrtc *findCrtc(struct randrResources *r, uint32_t id);
+void freeRandrResources(struct randrResources *r);
+struct layoutOutput *layoutCrtc(struct layout *l, uint32_t crtc);
+bool crtcMatches(struct randrCrtc *c, struct layoutOutput *lo);
+const char *rotationName(unsigned int rotation);
+bool parseRotation(const char *name, unsigned int *rotation);
+
+#endif
@@ -0,0 +1,138 @@
+#!/bin/sh
+#
+# Benchmark fling end to end against a headless Xvfb populated with a
+# synthetic window tree.  See usage below, or run "make bench
+# BENCH_ARGS='...'".
+
+usage() {
+    echo "usage: $0 [-d depth] [-f fanout] [-c clients] [-e emacs] [-l]
+                [-L latency-ms] [-n runs] [-p paths] [-- fling-args...]
+
+Start Xvfb, create a tree of fanout^depth leaf windows of which
+<clients> are WM_STATE clients and <emacs> of those are Emacs, and run
+fling <runs> times against it, dropping <paths> paths each time.
+
+  -l  publish _NET_CLIENT_LIST, as an EWMH window manager would
+  -L  forward fling's connection through a proxy that adds this much
+      round-trip latency, to imitate ssh X forwarding
+
+Reports wall time, X requests, round trips and peak RSS." >&2
+    exit 2
+}
+
+set -e
+
+DEPTH=3
+FANOUT=10
+CLIENTS=50
+EMACS=2
+CLIENT_LIST=
+LATENCY=
+RUNS=10
+PATHS=1
+while getopts "d:f:c:e:lL:n:p:" opt; do
+    case $opt in
+        d) DEPTH=$OPTARG ;;
+        f) FANOUT=$OPTARG ;;
+        c) CLIENTS=$OPTARG ;;
+        e) EMACS=$OPTARG ;;
+        l) CLIENT_LIST=-l ;;
+        L) LATENCY=$OPTARG ;;
+        n) RUNS=$OPTARG ;;
+        p) PATHS=$OPTARG ;;
+        *) usage ;;
+    esac
+done
+shift $(expr $OPTIND - 1)
+
+HERE=$(cd $(dirname $0) && pwd)
+TMP=$(mktemp -d)
+PIDS=
+cleanup() {
+    for pid in $PIDS; do
+        kill $pid 2>/dev/null || true
+    done
+    rm -rf $TMP
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+# Wait for $1 to exist and be non-empty.
+wait_for() {
+    for i in $(seq 100); do
+        if [ -s "$1" ]; then
+            return 0
+        fi
+        sleep 0.1
+    done
+    echo "Timed out waiting for $1" >&2
+    exit 1
+}
+
+free_display() {
+    n=${1:-90}
+    while [ -e /tmp/.X11-unix/X$n -o -e /tmp/.X$n-lock ]; do
+        n=$(expr $n + 1)
+    done
+    echo $n
+}
+
+XDISPLAY=$(free_display)
+Xvfb :$XDISPLAY -nolisten tcp -screen 0 1280x1024x24 >$TMP/xvfb.log 2>&1 &
+PIDS="$PIDS $!"
+wait_for /tmp/.X11-unix/X$XDISPLAY
+
+DISPLAY=:$XDISPLAY $HERE/flingbench tree -d $DEPTH -f $FANOUT \
+    -c $CLIENTS -e $EMACS $CLIENT_LIST >$TMP/tree.log &
+PIDS="$PIDS $!"
+wait_for $TMP/tree.log
+head -n1 $TMP/tree.log | sed "s/^ready //"
+
+FLING_DISPLAY=:$XDISPLAY
+if [ -n "$LATENCY" ]; then
+    PDISPLAY=$(free_display $(expr $XDISPLAY + 1))
+    $HERE/flingbench proxy -l $LATENCY $PDISPLAY $XDISPLAY >$TMP/proxy.log &
+    PIDS="$PIDS $!"
+    wait_for $TMP/proxy.log
+    FLING_DISPLAY=:$PDISPLAY
+    echo "with $LATENCY ms round-trip latency"
+fi
+
+for i in $(seq $PATHS); do
+    echo "$TMP/file$i"
+done >$TMP/paths
+
+for i in $(seq $RUNS); do
+    DISPLAY=$FLING_DISPLAY FLING_STATS=1 $HERE/fling "$@" - \
+        <$TMP/paths 2>>$TMP/stats
+done
+
+DROPS=$(grep -c ^dropped $TMP/tree.log || true)
+if [ "$DROPS" != "$RUNS" ]; then
+    echo "Only $DROPS of $RUNS drops arrived" >&2
+    cat $TMP/stats >&2
+    exit 1
+fi
+
+# Summarize each field as min/mean/max
+grep ^fling-stats $TMP/stats | awk '
+{
+    for (i = 2; i <= NF; i++) {
+        split($i, kv, "=")
+        k = kv[1]; v = kv[2] + 0
+        if (!(k in sum)) {
+            keys[++nkeys] = k; min[k] = v; max[k] = v
+        }
+        sum[k] += v
+        if (v < min[k]) min[k] = v
+        if (v > max[k]) max[k] = v
+    }
+    n++
+}
+END {
+    printf "%-12s %12s %12s %12s\n", "", "min", "mean", "max"
+    for (i = 1; i <= nkeys; i++) {
+        k = keys[i]
+        printf "%-12s %12.3f %12.3f %12.3f\n", k, min[k], sum[k] / n, max[k]
+    }
+}'
@@ -1,15 +1,28 @@
 #define _GNU_SOURCE /* get_current_dir_name */
+#include <errno.h>
+#include <fnmatch.h>
+#include <poll.h>
+#include <regex.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
 #include <sys/utsname.h>
 
-#include <pth.h>
 #include <xcb/xcb.h>
 #include <xcb/xcb_event.h>
 
+#include "xcbasync.h"
+
 #define DEBUG 0
 
 void
@@ -20,311 +33,1449 @@ panic(const char *str)
 }
 
 //////////////////////////////////////////////////////////////////
-// XCB/Pth
+// XCB util
 //
 
-struct xcb_task
+// The connection for this thread.  Each thread that talks to the
+// server opens its own and hands it to xa_init.
+static __thread xcb_connection_t *conn;
+
+static const xcb_setup_t *setup;
+static xcb_screen_t *screen;
+
+// The root windows of all screens.
+static xcb_window_t *roots;
+static int nroots;
+
+static bool
+is_root(xcb_window_t win)
+{
+        for (int i = 0; i < nroots; ++i)
+                if (roots[i] == win)
+                        return true;
+        return false;
+}
+
+// Every atom fling uses.  intern_atoms interns these all in one
+// batch when we connect, so nothing else ever waits on InternAtom.
+#define FLING_ATOMS                                             \
+        X(WM_STATE, "WM_STATE")                                 \
+        X(_NET_WM_USER_TIME, "_NET_WM_USER_TIME")               \
+        X(_NET_WM_USER_TIME_WINDOW, "_NET_WM_USER_TIME_WINDOW") \
+        X(_NET_WM_PID, "_NET_WM_PID")                           \
+        X(_NET_WM_DESKTOP, "_NET_WM_DESKTOP")                   \
+        X(_NET_WM_NAME, "_NET_WM_NAME")                         \
+        X(UTF8_STRING, "UTF8_STRING")                           \
+        X(_NET_CLIENT_LIST, "_NET_CLIENT_LIST")                 \
+        X(_NET_SUPPORTING_WM_CHECK, "_NET_SUPPORTING_WM_CHECK") \
+        X(XdndAware, "XdndAware")                               \
+        X(XdndSelection, "XdndSelection")                       \
+        X(XdndEnter, "XdndEnter")                               \
+        X(XdndLeave, "XdndLeave")                               \
+        X(XdndPosition, "XdndPosition")                         \
+        X(XdndStatus, "XdndStatus")                             \
+        X(XdndDrop, "XdndDrop")                                 \
+        X(XdndFinished, "XdndFinished")                         \
+        X(textUriList, "text/uri-list")                         \
+        X(XdndActionCopy, "XdndActionCopy")                     \
+        X(INCR, "INCR")
+
+enum
 {
-        pth_uctx_t ctx;
-        struct xcb_task *next, *prev;
+#define X(id, name) ATOM_##id,
+        FLING_ATOMS
+#undef X
+        NATOMS
+};
 
-        void (*start)(void*);
-        void *arg;
-        bool dead;
+static const char *atom_names[NATOMS] = {
+#define X(id, name) name,
+        FLING_ATOMS
+#undef X
 };
 
-static struct xcb_task xcb_task_main;
-static struct xcb_task *xcb_task_cur;
+static xcb_atom_t atoms[NATOMS];
 
-void xcb_wait(void);
+#define ATOM(id) (atoms[ATOM_##id])
 
-static void
-xcb_spawn_trampoline(void *opaque)
+// If the atom cache is in use, the GetAtomName request that checks
+// it.  The check is sent along with the first real requests and only
+// collected by atoms_verified.
+static bool atom_check_pending;
+static xcb_get_atom_name_cookie_t atom_check;
+static int atom_check_id;
+
+// Return the path of the named cache file for this display, or NULL
+// if caching is disabled.  Caches are opt-in: set FLING_CACHE to a
+// directory to enable them.
+static char *
+cache_path(const char *name)
 {
-        xcb_task_cur->start(xcb_task_cur->arg);
-        xcb_task_cur->dead = true;
-        xcb_wait();
-        panic("Dead thread executed");
+        const char *dir = getenv("FLING_CACHE");
+        const char *display = getenv("DISPLAY");
+        if (!dir || !*dir || !display)
+                return NULL;
+        char *path;
+        asprintf(&path, "%s/%s.%s", dir, name, display);
+        for (char *p = path + strlen(dir) + 1; *p; ++p)
+                if (*p == '/')
+                        *p = '_';
+        return path;
 }
 
-void
-xcb_spawn(void (*func)(void *), void *arg)
-{
-        // Set up main task if necessary
-        if (!xcb_task_cur) {
-                if (!pth_uctx_create(&xcb_task_main.ctx))
-                        panic("main pth_uctx_create failed");
-                if (!pth_uctx_make(xcb_task_main.ctx, NULL, 16*1024, NULL,
-                                   (void(*)(void*))(-1), NULL, NULL))
-                        panic("main pth_uctx_make failed");
-                xcb_task_main.next = xcb_task_main.prev = &xcb_task_main;
-                xcb_task_cur = &xcb_task_main;
-        }
-
-        // Allocate a task
-        struct xcb_task *task = calloc(1, sizeof *task);
-        if (!task)
-                panic("failed to malloc task");
-
-        task->start = func;
-        task->arg = arg;
-        if (!pth_uctx_create(&task->ctx))
-                panic("pth_uctx_create failed");
-        if (!pth_uctx_make(task->ctx, NULL, 16*1024, NULL,
-                           xcb_spawn_trampoline, NULL, NULL))
-                panic("pth_uctx_make failed");
-
-        // Execute the child up to its first wait (or exit).  This is
-        // good for efficiency, but also important to make the
-        // children send their initial requests in order.  First,
-        // schedule a little ring of just this task and the child.
-        struct xcb_task *prev = xcb_task_cur->prev,
-                *next = xcb_task_cur->next;
-        xcb_task_cur->next = xcb_task_cur->prev = task;
-        task->next = task->prev = xcb_task_cur;
-        xcb_wait();
-        // Then piece that ring back into the bigger task ring with
-        // the added task (or tasks, if the child spawned, too) behind
-        // this task.
-        xcb_task_cur->next = next;
-        xcb_task_cur->prev->prev = prev;
-        prev->next = xcb_task_cur->prev;
+// Atoms and window IDs only mean something for one server, so caches
+// are keyed by the server's vendor and release as well as the
+// display.
+static char *
+cache_key(void)
+{
+        char *key;
+        asprintf(&key, "%.*s %u %s", xcb_setup_vendor_length(setup),
+                 xcb_setup_vendor(setup), setup->release_number,
+                 getenv("DISPLAY"));
+        return key;
 }
 
-void
-xcb_wait(void)
+static bool
+load_atom_cache(void)
 {
-        if (!xcb_task_cur)
-                return;
+        char *path = cache_path("atoms");
+        if (!path)
+                return false;
+        FILE *f = fopen(path, "r");
+        free(path);
+        if (!f)
+                return false;
 
-        // Reap threads
-        while (xcb_task_cur->next->dead) {
-                struct xcb_task *reap = xcb_task_cur->next;
-                reap->next->prev = reap->prev;
-                reap->prev->next = reap->next;
-                pth_uctx_destroy(reap->ctx);
-                free(reap);
+        char *key = cache_key(), *line = NULL;
+        size_t cap = 0;
+        bool ok = getline(&line, &cap, f) > 0 &&
+                strcspn(line, "\n") == strlen(key) &&
+                strncmp(line, key, strlen(key)) == 0;
+        for (int i = 0; ok && i < NATOMS; ++i) {
+                char name[64];
+                unsigned int val;
+                ok = fscanf(f, "%63s %u", name, &val) == 2 &&
+                        strcmp(name, atom_names[i]) == 0 && val != 0;
+                atoms[i] = val;
         }
-        if (xcb_task_cur == xcb_task_cur->next)
+        free(line);
+        free(key);
+        fclose(f);
+        if (!ok)
+                return false;
+
+        // A server restart can reuse the same key with different
+        // atoms.  Spot check the most recently interned atom, which
+        // is the one most likely to have changed.
+        atom_check_id = 0;
+        for (int i = 1; i < NATOMS; ++i)
+                if (atoms[i] > atoms[atom_check_id])
+                        atom_check_id = i;
+        atom_check = xcb_get_atom_name(conn, atoms[atom_check_id]);
+        XA_TRACE_REQ("GetAtomName", atom_check);
+        atom_check_pending = true;
+        return true;
+}
+
+static void
+save_atom_cache(void)
+{
+        char *path = cache_path("atoms"), *tmp;
+        if (!path)
                 return;
+        asprintf(&tmp, "%s.%d", path, (int)getpid());
+        FILE *f = fopen(tmp, "w");
+        if (f) {
+                char *key = cache_key();
+                fprintf(f, "%s\n", key);
+                free(key);
+                for (int i = 0; i < NATOMS; ++i)
+                        fprintf(f, "%s %u\n", atom_names[i], atoms[i]);
+                if (fclose(f) == 0)
+                        rename(tmp, path);
+                else
+                        unlink(tmp);
+        }
+        free(tmp);
+        free(path);
+}
 
-        // XXX Testing synchronous execution
-//        if (!xcb_task_cur->dead && xcb_task_cur != &xcb_task_main)
-//                return;
+// Intern every atom in FLING_ATOMS, either from the cache or in a
+// single pipelined batch.
+void
+intern_atoms(bool use_cache)
+{
+        if (use_cache && load_atom_cache())
+                return;
 
-        // Roll the task ring
-        xcb_task_cur = xcb_task_cur->next;
+        xcb_intern_atom_cookie_t ia[NATOMS];
+        for (int i = 0; i < NATOMS; ++i) {
+                ia[i] = xcb_intern_atom(conn, false, strlen(atom_names[i]),
+                                        atom_names[i]);
+                XA_TRACE_REQ("InternAtom", ia[i]);
+        }
+        for (int i = 0; i < NATOMS; ++i) {
+                xcb_intern_atom_reply_t *iar = xa_await(ia[i].sequence, NULL);
+                if (!iar) {
+                        fprintf(stderr, "Failed to intern %s\n", atom_names[i]);
+                        exit(1);
+                }
+                atoms[i] = iar->atom;
+                free(iar);
+        }
+        save_atom_cache();
+}
 
-        // Switch.  Has to be the last thing we do in case the task
-        // we're switching into is a new thread.
-        pth_uctx_switch(xcb_task_cur->prev->ctx, xcb_task_cur->ctx);
+// Return whether the atoms came from a cache that turned out to be
+// wrong.  If so, this re-interns them and the caller must redo
+// anything that used the old values.
+bool
+atoms_stale(void)
+{
+        if (!atom_check_pending)
+                return false;
+        atom_check_pending = false;
+        xcb_get_atom_name_reply_t *r = xa_await(atom_check.sequence, NULL);
+        const char *want = atom_names[atom_check_id];
+        bool ok = r &&
+                (size_t)xcb_get_atom_name_name_length(r) == strlen(want) &&
+                memcmp(xcb_get_atom_name_name(r), want, strlen(want)) == 0;
+        free(r);
+        if (ok)
+                return false;
+        intern_atoms(false);
+        return true;
 }
 
-// Ah, the wonders of CPP.  We need a few levels to get it to expand
-// __LINE__.
-#define XCB_ASYNC __XCB_ASYNC(__LINE__)
-#define __XCB_ASYNC(uniq) ____XCB_ASYNC(uniq)
-#define ____XCB_ASYNC(uniq)                                 \
-        auto void __xcb_async_thread##uniq(void *__opaque); \
-        xcb_spawn(__xcb_async_thread##uniq, NULL);          \
-        void __xcb_async_thread##uniq(void *__opaque)
+// The arena for the current target lookup.  In daemon mode, this is
+// released whenever the tasks handling a batch of events finish.
+static __thread struct xa_arena scan_arena;
 
 //////////////////////////////////////////////////////////////////
-// XCB util
+// Main
 //
 
-static xcb_connection_t *conn;
-static const xcb_setup_t *setup;
-static xcb_screen_t *screen;
+// The result of looking for Emacs windows in some set of windows.
+struct targets
+{
+        bool found_some, found_visible;
+        uint32_t best_user_time;
+        xcb_window_t best_window;
+};
 
-xcb_atom_t
-__get_atom(const char *name, xcb_atom_t *store)
+// Every Emacs window found, visible or not, for the target cache.
+struct seen_target
 {
-        if (!(*store)) {
-                xcb_intern_atom_cookie_t ia =
-                        xcb_intern_atom(conn, false, strlen(name), name);
-                xcb_wait();
-                xcb_intern_atom_reply_t *iar =
-                        xcb_intern_atom_reply(conn, ia, NULL);
-                *store = iar->atom;
-                free(iar);
+        xcb_window_t win;
+        bool viewable;
+        uint32_t user_time;
+};
+static __thread struct seen_target *seen;
+static __thread int nseen, seen_cap;
+
+// In daemon mode, every Emacs window found goes into the daemon's
+// window table instead of a result, and windows that don't match
+// leave it.
+static bool daemon_mode;
+void daemon_update(xcb_window_t win, xcb_window_t time_win, bool viewable,
+                   uint32_t user_time);
+void daemon_reject(xcb_window_t win);
+
+// Fold the Emacs window from into t.
+static void
+merge_targets(struct targets *t, const struct targets *from)
+{
+        if (from->found_some)
+                t->found_some = true;
+        if (!from->found_visible)
+                return;
+        t->found_visible = true;
+        if (!t->best_user_time || from->best_user_time > t->best_user_time) {
+                t->best_user_time = from->best_user_time;
+                t->best_window = from->best_window;
         }
-        return *store;
 }
 
-#define ATOM(name) ({static xcb_atom_t __atom; __get_atom(name, &__atom);})
+static void
+note_seen(const struct seen_target *st)
+{
+        if (nseen == seen_cap) {
+                seen_cap = seen_cap ? 2 * seen_cap : 16;
+                seen = realloc(seen, seen_cap * sizeof *seen);
+                if (!seen)
+                        panic("failed to realloc seen targets");
+        }
+        seen[nseen++] = *st;
+}
 
-bool
-has_property(xcb_window_t win, xcb_atom_t atom)
-{
-        xcb_get_property_cookie_t gp =
-                xcb_get_property(conn, false, win, atom,
-                                 XCB_GET_PROPERTY_TYPE_ANY, 0, 0);
-        xcb_wait();
-        xcb_get_property_reply_t *gpr = xcb_get_property_reply(conn, gp, NULL);
-        bool res = gpr->type != 0;
-        free(gpr);
-        return res;
+// Record a matching window.  time_win is the window that carries its
+// user time, if that's not win itself.
+void
+note_target(struct targets *t, xcb_window_t win, xcb_window_t time_win,
+            bool viewable, uint32_t user_time)
+{
+        if (daemon_mode) {
+                daemon_update(win, time_win, viewable, user_time);
+                return;
+        }
+        note_seen(&(struct seen_target){win, viewable, user_time});
+        merge_targets(t, &(struct targets){true, viewable, user_time, win});
 }
 
-void *
-get_property(xcb_window_t win, xcb_atom_t atom, xcb_atom_t type, int format, void *out, int max)
+// A target matcher.  The spec is a comma-separated list of
+// predicates, all of which a window must satisfy:
+//
+//   instance=GLOB  the WM_CLASS instance name
+//   class=GLOB     the WM_CLASS class name
+//   title=REGEX    _NET_WM_NAME, or WM_NAME if that's unset
+//   pid=N          _NET_WM_PID
+//   desktop=N      _NET_WM_DESKTOP (sticky windows match any N)
+//
+// compile_match turns it into a plan of which properties to fetch
+// and how much of each, so consider_target requests only what the
+// plan tests.  Of the matching windows, fling picks the viewable one
+// with the highest user time.
+
+#define MATCH_DEFAULT "instance=emacs"
+#define MATCH_MAX_STRING 4096
+
+struct match_plan
 {
-        xcb_get_property_cookie_t gp =
-                xcb_get_property(conn, false, win, atom, type, 0, max);
-        xcb_wait();
-        xcb_get_property_reply_t *gpr = xcb_get_property_reply(conn, gp, NULL);
-        void *res = NULL;
-        if (gpr->type == type && gpr->format == format) {
-                int len = xcb_get_property_value_length(gpr);
-                if (out)
-                        res = out;
-                else
-                        res = malloc(len);
-                if (!res) {
-                        perror("malloc");
-                        abort();
+        const char *spec;
+        // fnmatch patterns, or NULL
+        char *instance, *class;
+        // Bytes of WM_CLASS to fetch, or 0 if not needed
+        int class_max;
+        bool has_title;
+        regex_t title;
+        bool has_pid, has_desktop;
+        uint32_t pid, desktop;
+};
+
+static struct match_plan match_plan;
+
+static bool
+parse_card32(const char *str, uint32_t *out)
+{
+        char *end;
+        errno = 0;
+        unsigned long v = strtoul(str, &end, 0);
+        *out = v;
+        return *str && !*end && !errno && v <= UINT32_MAX;
+}
+
+void
+compile_match(const char *spec)
+{
+        struct match_plan *p = &match_plan;
+        p->spec = spec;
+        if (strchr(spec, '\n'))
+                goto bad;
+        char *copy = strdup(spec), *save = NULL;
+        for (char *pred = strtok_r(copy, ",", &save); pred;
+             pred = strtok_r(NULL, ",", &save)) {
+                char *val = strchr(pred, '=');
+                if (!val)
+                        goto bad;
+                *val++ = 0;
+                if (strcmp(pred, "instance") == 0) {
+                        p->instance = strdup(val);
+                } else if (strcmp(pred, "class") == 0) {
+                        p->class = strdup(val);
+                } else if (strcmp(pred, "title") == 0) {
+                        int err = regcomp(&p->title, val,
+                                          REG_EXTENDED | REG_NOSUB);
+                        if (err) {
+                                char msg[256];
+                                regerror(err, &p->title, msg, sizeof msg);
+                                fprintf(stderr, "Bad title regexp: %s\n", msg);
+                                exit(1);
+                        }
+                        p->has_title = true;
+                } else if (strcmp(pred, "pid") == 0) {
+                        if (!parse_card32(val, &p->pid))
+                                goto bad;
+                        p->has_pid = true;
+                } else if (strcmp(pred, "desktop") == 0) {
+                        if (!parse_card32(val, &p->desktop))
+                                goto bad;
+                        p->has_desktop = true;
+                } else {
+                        goto bad;
                 }
-                memmove(res, xcb_get_property_value(gpr), len);
         }
-        free(gpr);
-        return res;
+        free(copy);
+
+        // A literal instance name only needs that many bytes of
+        // WM_CLASS, plus the NUL that ends it.
+        if (p->class || (p->instance && strpbrk(p->instance, "*?[\\")))
+                p->class_max = MATCH_MAX_STRING;
+        else if (p->instance)
+                p->class_max = strlen(p->instance) + 1;
+        return;
+
+bad:
+        fprintf(stderr, "Bad match predicate in \"%s\"\n", spec);
+        exit(1);
 }
 
-char *
-string_property(xcb_window_t win, xcb_atom_t atom)
+// Return whether a change to atom can change whether a window
+// matches the plan.
+static bool
+match_watches(xcb_atom_t atom)
 {
-        return get_property(win, atom, XCB_ATOM_STRING, 8, NULL, 4096);
+        const struct match_plan *p = &match_plan;
+        if (p->class_max && atom == XCB_ATOM_WM_CLASS)
+                return true;
+        if (p->has_title && (atom == ATOM(_NET_WM_NAME) ||
+                             atom == XCB_ATOM_WM_NAME))
+                return true;
+        if (p->has_pid && atom == ATOM(_NET_WM_PID))
+                return true;
+        return p->has_desktop && atom == ATOM(_NET_WM_DESKTOP);
 }
 
-uint32_t
-card32_property(xcb_window_t win, xcb_atom_t atom)
+// Copy a borrowed string property into the arena and NUL-terminate
+// it.
+static char *
+arena_strndup(struct xa_arena *a, const void *val, int len)
 {
-        uint32_t res = 0;
-        get_property(win, atom, XCB_ATOM_CARDINAL, 32, &res, sizeof(res));
-        return res;
+        char *str = xa_arena_alloc(a, len + 1);
+        memcpy(str, val, len);
+        str[len] = 0;
+        return str;
 }
 
-xcb_atom_t
-atom_property(xcb_window_t win, xcb_atom_t atom)
+static bool
+match_class(const char *cls, int len)
 {
-        xcb_atom_t res = 0;
-        get_property(win, atom, XCB_ATOM_ATOM, 32, &res, sizeof(res));
-        return res;
+        const struct match_plan *p = &match_plan;
+        const char *instance = arena_strndup(&scan_arena, cls, len);
+        // WM_CLASS is instance\0class\0
+        int ilen = strlen(instance);
+        if (p->instance && fnmatch(p->instance, instance, 0) != 0)
+                return false;
+        if (p->class && (ilen >= len ||
+                         fnmatch(p->class, instance + ilen + 1, 0) != 0))
+                return false;
+        return true;
 }
 
-//////////////////////////////////////////////////////////////////
-// Main
-//
+// The requests consider_target has sent but not yet consumed.
+struct match_reqs
+{
+        // One per predicate property (pid, desktop, class and two for
+        // title), plus the window attributes and two user time
+        // properties
+        unsigned int seq[8];
+        int n;
+};
 
-static bool found_some, found_visible;
-static uint32_t best_user_time;
-static xcb_window_t best_window;
+// Record the request seq as sent.
+static void
+match_push(struct match_reqs *r, unsigned int seq)
+{
+        if (r->n == sizeof r->seq / sizeof *r->seq)
+                panic("too many match requests");
+        r->seq[r->n++] = seq;
+}
+
+static xcb_get_property_cookie_t
+match_get_property(struct match_reqs *r, xcb_window_t win, xcb_atom_t atom,
+                   xcb_atom_t type, int max)
+{
+        xcb_get_property_cookie_t gp = xa_get_property_start(win, atom, type,
+                                                             max);
+        match_push(r, gp.sequence);
+        return gp;
+}
+
+// Mark the request seq as consumed.  Returns seq.
+static unsigned int
+match_take(struct match_reqs *r, unsigned int seq)
+{
+        for (int i = 0; i < r->n; ++i)
+                if (r->seq[i] == seq)
+                        r->seq[i] = r->seq[--r->n];
+        return seq;
+}
+
+static void
+match_discard(struct match_reqs *r)
+{
+        for (int i = 0; i < r->n; ++i)
+                xa_discard(r->seq[i]);
+        r->n = 0;
+}
+
+// Get a 32-bit property from an xa_get_property_start into *out.  If
+// it's missing, set *out to 0 and return false.
+static bool
+match_card32(struct match_reqs *r, xcb_get_property_cookie_t gp,
+             xcb_atom_t type, uint32_t *out)
+{
+        const void *val;
+        *out = 0;
+        match_take(r, gp.sequence);
+        if (xa_get_property_borrow(&scan_arena, gp, type, 32, &val) <
+            (int)sizeof(uint32_t))
+                return false;
+        *out = *(const uint32_t*)val;
+        return true;
+}
 
 void
-consider_target(xcb_window_t win)
+consider_target(xcb_window_t win, struct targets *out)
 {
-        // Just Emacs windows
-        char *cls = string_property(win, XCB_ATOM_WM_CLASS);
-        if (!(cls && strcmp(cls, "emacs") == 0)) {
-                free(cls);
-                return;
-        }
-        free(cls);
-        found_some = true;
+        const struct match_plan *p = &match_plan;
+        struct xa_arena *a = &scan_arena;
+        struct match_reqs r = {.n = 0};
 
-        // Consider only visible windows
+        // Send every request the plan needs at once, so each
+        // candidate costs a single round trip.  Predicates go out
+        // cheapest first, and replies come back in order, so a
+        // window that fails a cheap test never waits for the
+        // expensive ones.  It still pays for sending the rest, and
+        // for the server's replies to them: the window-state
+        // requests below go out before any predicate is checked.
+        xcb_get_property_cookie_t pid, desktop, cls, title, wm_name;
+        if (p->has_pid)
+                pid = match_get_property(&r, win, ATOM(_NET_WM_PID),
+                                         XCB_ATOM_CARDINAL, sizeof(uint32_t));
+        if (p->has_desktop)
+                desktop = match_get_property(&r, win, ATOM(_NET_WM_DESKTOP),
+                                             XCB_ATOM_CARDINAL,
+                                             sizeof(uint32_t));
+        if (p->class_max)
+                cls = match_get_property(&r, win, XCB_ATOM_WM_CLASS,
+                                         XCB_ATOM_STRING, p->class_max);
+        if (p->has_title) {
+                title = match_get_property(&r, win, ATOM(_NET_WM_NAME),
+                                           ATOM(UTF8_STRING),
+                                           MATCH_MAX_STRING);
+                wm_name = match_get_property(&r, win, XCB_ATOM_WM_NAME,
+                                             XCB_GET_PROPERTY_TYPE_ANY,
+                                             MATCH_MAX_STRING);
+        }
         xcb_get_window_attributes_cookie_t wa =
                 xcb_get_window_attributes(conn, win);
-        xcb_wait();
-        xcb_get_window_attributes_reply_t *war =
-                xcb_get_window_attributes_reply (conn, wa, NULL);
-        if (war->map_state != XCB_MAP_STATE_VIEWABLE) {
-                free(war);
-                return;
+        XA_TRACE_REQ("GetWindowAttributes", wa);
+        match_push(&r, wa.sequence);
+        xcb_get_property_cookie_t utw =
+                match_get_property(&r, win, ATOM(_NET_WM_USER_TIME_WINDOW),
+                                   XCB_ATOM_WINDOW, sizeof(xcb_window_t));
+        xcb_get_property_cookie_t ut =
+                match_get_property(&r, win, ATOM(_NET_WM_USER_TIME),
+                                   XCB_ATOM_CARDINAL, sizeof(uint32_t));
+
+        uint32_t v;
+        if (p->has_pid && (!match_card32(&r, pid, XCB_ATOM_CARDINAL, &v) ||
+                           v != p->pid))
+                goto no;
+        // Per EWMH, 0xFFFFFFFF means all desktops.  Windows without
+        // the property can't be excluded either.
+        if (p->has_desktop &&
+            match_card32(&r, desktop, XCB_ATOM_CARDINAL, &v) &&
+            v != p->desktop && v != 0xFFFFFFFF)
+                goto no;
+        if (p->class_max) {
+                const void *val;
+                int len = xa_get_property_borrow(a, cls, XCB_ATOM_STRING, 8,
+                                                 &val);
+                match_take(&r, cls.sequence);
+                if (len <= 0 || !match_class(val, len))
+                        goto no;
+        }
+        if (p->has_title) {
+                const void *val;
+                int len = xa_get_property_borrow(a, title, ATOM(UTF8_STRING), 8,
+                                                 &val);
+                match_take(&r, title.sequence);
+                if (len < 0) {
+                        xcb_get_property_reply_t *gpr =
+                                xa_arena_own(a, xa_await(match_take
+                                                         (&r, wm_name.sequence),
+                                                         NULL));
+                        if (!gpr || gpr->format != 8)
+                                goto no;
+                        val = xcb_get_property_value(gpr);
+                        len = xcb_get_property_value_length(gpr);
+                }
+                if (regexec(&p->title, arena_strndup(a, val, len), 0, NULL,
+                            0) != 0)
+                        goto no;
         }
-        free(war);
-        found_visible = true;
 
-        // Get access time (XXX support _NET_WM_USER_TIME_WINDOW)
-        uint32_t user_time = card32_property(win, ATOM("_NET_WM_USER_TIME"));
+        // Consider only visible windows
+        xcb_get_window_attributes_reply_t *war =
+                xa_arena_own(a, xa_await(match_take(&r, wa.sequence), NULL));
+        if (!war)
+                // The window is gone
+                goto no;
+        bool viewable = war->map_state == XCB_MAP_STATE_VIEWABLE;
+
+        // Get access time.  Clients can put it on a separate window
+        // so updating it doesn't wake up everyone watching the
+        // top-level window's properties; GTK does this.  That costs
+        // a second round trip, but only for windows that match.
+        xcb_window_t time_win;
+        uint32_t user_time;
+        match_card32(&r, utw, XCB_ATOM_WINDOW, &time_win);
+        match_card32(&r, ut, XCB_ATOM_CARDINAL, &user_time);
+        match_discard(&r);
+        if (time_win) {
+                xcb_get_property_cookie_t tut =
+                        xa_get_property_start(time_win, ATOM(_NET_WM_USER_TIME),
+                                              XCB_ATOM_CARDINAL,
+                                              sizeof(uint32_t));
+                if (match_card32(&r, tut, XCB_ATOM_CARDINAL, &v))
+                        user_time = v;
+        }
 #if DEBUG
-        printf("Visible %#x user_time %u\n", win, user_time);
+        if (viewable)
+                printf("Visible %#x user_time %u\n", win, user_time);
 #endif
-        if (!best_user_time || user_time > best_user_time) {
-                best_user_time = user_time;
-                best_window = win;
+        note_target(out, win, time_win, viewable, user_time);
+        return;
+
+no:
+        match_discard(&r);
+        if (daemon_mode)
+                daemon_reject(win);
+}
+
+// The argument and result of a task that looks for Emacs windows
+// under (or at) win.
+struct target_search
+{
+        xcb_window_t win;
+        struct targets res;
+        // For callers that keep searches in a list
+        struct target_search *next;
+};
+
+static struct target_search *
+new_target_search(xcb_window_t win)
+{
+        struct target_search *ts = xa_arena_alloc(&scan_arena, sizeof *ts);
+        memset(ts, 0, sizeof *ts);
+        ts->win = win;
+        return ts;
+}
+
+static void
+consider_target_task(void *op)
+{
+        struct target_search *ts = op;
+        consider_target(ts->win, &ts->res);
+}
+
+static void get_top_level_windows_task(void *op);
+
+// Run task on each of wins in a group, wait for them all, and merge
+// their results into out.
+static void
+search_windows(void (*task)(void*), const xcb_window_t *wins, int n,
+               struct targets *out)
+{
+        struct target_search *ts = xa_arena_alloc(&scan_arena, n * sizeof *ts);
+        struct xa_group g = {};
+        for (int i = 0; i < n; ++i) {
+                ts[i] = (struct target_search){.win = wins[i]};
+                xa_spawn_group(&g, task, &ts[i]);
         }
+        xa_join(&g);
+        for (int i = 0; i < n; ++i)
+                merge_targets(out, &ts[i].res);
 }
 
 void
-get_top_level_windows(xcb_window_t win)
+get_top_level_windows(xcb_window_t win, struct targets *out)
 {
         // Is win top-level?  According to the ICCCM, top-level
         // windows have a WM_STATE property.  See also
         // XmuClientWindow.
-        if (has_property(win, ATOM("WM_STATE"))) {
-                consider_target(win);
+        if (xa_has_property(win, ATOM(WM_STATE))) {
+                consider_target(win, out);
                 return;
         }
 
-        // Not a top-level window.  Get its children.
+        // Not a top-level window.  Search its children.
         xcb_query_tree_cookie_t qt = xcb_query_tree(conn, win);
-        xcb_wait();
-        xcb_query_tree_reply_t *qtr = xcb_query_tree_reply(conn, qt, NULL);
-
-        xcb_window_t *children = xcb_query_tree_children(qtr);
-        int nc = xcb_query_tree_children_length(qtr);
-        for (int i = 0; i < nc; ++i) {
-                void t(void *op)
-                {
-                        get_top_level_windows(*((xcb_window_t*)op));
+        XA_TRACE_REQ("QueryTree", qt);
+        xcb_query_tree_reply_t *qtr =
+                xa_arena_own(&scan_arena, xa_await(qt.sequence, NULL));
+        if (!qtr)
+                return;
+        search_windows(get_top_level_windows_task,
+                       xcb_query_tree_children(qtr),
+                       xcb_query_tree_children_length(qtr), out);
+}
+
+static void
+get_top_level_windows_task(void *op)
+{
+        struct target_search *ts = op;
+        get_top_level_windows(ts->win, &ts->res);
+}
+
+// A run of sibling windows borrowed from a QueryTree reply.
+struct window_run
+{
+        xcb_window_t *wins;
+        int n;
+};
+
+// Breadth-first alternative to get_top_level_windows.  Rather than
+// descending one window at a time, this sends the WM_STATE and
+// QueryTree requests for an entire level of the tree in one batch and
+// then collects the replies in order, so the walk costs one round
+// trip per level no matter how the tasks get scheduled.  Each level
+// is a list of runs pointing into the previous level's replies,
+// which the scan arena keeps alive.  Top-level windows are checked
+// by a group of consider_target tasks as they're found.
+void
+get_top_level_windows_bfs(xcb_window_t *wins, int nwins, struct targets *out)
+{
+        struct xa_arena *a = &scan_arena;
+        xcb_atom_t wm_state = ATOM(WM_STATE);
+        struct xa_group g = {};
+        struct target_search *found = NULL;
+
+        struct window_run *level = xa_arena_alloc(a, sizeof *level);
+        level[0] = (struct window_run){wins, nwins};
+        int nruns = 1, n = nwins;
+        while (n) {
+                xcb_get_property_cookie_t *gp =
+                        xa_arena_alloc(a, n * sizeof *gp);
+                xcb_query_tree_cookie_t *qt = xa_arena_alloc(a, n * sizeof *qt);
+                // Speculatively query the children of every window,
+                // even though top-level windows won't need them.
+                // That's cheaper than a second round trip.
+                int k = 0;
+                for (int r = 0; r < nruns; ++r) {
+                        for (int i = 0; i < level[r].n; ++i, ++k) {
+                                xcb_window_t win = level[r].wins[i];
+                                gp[k] = xcb_get_property(conn, false, win,
+                                                         wm_state,
+                                                         XCB_GET_PROPERTY_TYPE_ANY,
+                                                         0, 0);
+                                XA_TRACE_REQ("has_property", gp[k]);
+                                qt[k] = xcb_query_tree(conn, win);
+                                XA_TRACE_REQ("QueryTree", qt[k]);
+                        }
+                }
+
+                // Each window contributes at most one run to the
+                // next level.
+                struct window_run *next = xa_arena_alloc(a, n * sizeof *next);
+                int next_runs = 0, next_n = 0;
+                k = 0;
+                for (int r = 0; r < nruns; ++r) {
+                        for (int i = 0; i < level[r].n; ++i, ++k) {
+                                // Windows can disappear while we
+                                // walk, so tolerate errors.
+                                xcb_get_property_reply_t *gpr =
+                                        xa_await(gp[k].sequence, NULL);
+                                bool top = gpr && gpr->type != 0;
+                                free(gpr);
+                                if (top) {
+                                        xa_discard(qt[k].sequence);
+                                        struct target_search *ts =
+                                                new_target_search
+                                                (level[r].wins[i]);
+                                        ts->next = found;
+                                        found = ts;
+                                        xa_spawn_group(&g,
+                                                       consider_target_task,
+                                                       ts);
+                                        continue;
+                                }
+
+                                xcb_query_tree_reply_t *qtr =
+                                        xa_arena_own(a, xa_await(qt[k].sequence,
+                                                                 NULL));
+                                if (!qtr)
+                                        continue;
+                                int nc = xcb_query_tree_children_length(qtr);
+                                if (!nc)
+                                        continue;
+                                next[next_runs++] = (struct window_run){
+                                        xcb_query_tree_children(qtr), nc};
+                                next_n += nc;
+                        }
                 }
-                xcb_spawn(t, &children[i]);
+                level = next;
+                nruns = next_runs;
+                n = next_n;
         }
 
-        // Let the children get their windows before freeing the reply
-        xcb_wait();
-        free(qtr);
+        xa_join(&g);
+        for (; found; found = found->next)
+                merge_targets(out, &found->res);
 }
 
-void
-xcb_wait_and_check(xcb_void_cookie_t cookie, const char *info)
+// Take candidates from the window manager's _NET_CLIENT_LIST instead
+// of walking the tree.  EWMH window managers publish every managed
+// client there, so this finds the target in a constant number of
+// round trips.  Returns false if any root has no list or the window
+// manager that published it is gone, in which case the caller should
+// fall back to walking the tree.
+bool
+get_client_list_windows(const xcb_window_t *roots, int nroots,
+                        struct targets *out)
 {
-        xcb_wait();
-        xcb_generic_error_t *err = xcb_request_check(conn, cookie);
-        if (err) {
-                fprintf(stderr, "X error %s: %s\n", info,
+        struct xa_arena *a = &scan_arena;
+        int seen_mark = nseen;
+        xcb_atom_t client_list = ATOM(_NET_CLIENT_LIST);
+        xcb_atom_t wm_check = ATOM(_NET_SUPPORTING_WM_CHECK);
+
+        xcb_get_property_cookie_t *cl = xa_arena_alloc(a, nroots * sizeof *cl);
+        xcb_get_property_cookie_t *rc = xa_arena_alloc(a, nroots * sizeof *rc);
+        for (int r = 0; r < nroots; ++r) {
+                cl[r] = xa_get_property_start(roots[r], client_list,
+                                              XCB_ATOM_WINDOW,
+                                              65536 * sizeof(xcb_window_t));
+                rc[r] = xa_get_property_start(roots[r], wm_check,
+                                              XCB_ATOM_WINDOW,
+                                              sizeof(xcb_window_t));
+        }
+        const void **lists = xa_arena_alloc(a, nroots * sizeof *lists);
+        int *lens = xa_arena_alloc(a, nroots * sizeof *lens);
+        xcb_window_t *wms = xa_arena_alloc(a, nroots * sizeof *wms);
+        bool ok = true;
+        for (int r = 0; r < nroots; ++r) {
+                lens[r] = xa_get_property_borrow(a, cl[r], XCB_ATOM_WINDOW, 32,
+                                                 &lists[r]);
+                wms[r] = 0;
+                xa_get_property_finish(rc[r], XCB_ATOM_WINDOW, 32, &wms[r],
+                                       sizeof(wms[r]));
+                if (lens[r] < 0 || !wms[r])
+                        ok = false;
+        }
+        if (!ok)
+                return false;
+
+        // A window manager that exits can leave its properties on
+        // the root behind.  Per EWMH, the check window must point to
+        // itself while the window manager is alive.  Check that in
+        // the same batch as the candidates.
+        xcb_get_property_cookie_t *wc = xa_arena_alloc(a, nroots * sizeof *wc);
+        struct target_search **ts = xa_arena_alloc(a, nroots * sizeof *ts);
+        struct xa_group g = {};
+        for (int r = 0; r < nroots; ++r) {
+                wc[r] = xa_get_property_start(wms[r], wm_check, XCB_ATOM_WINDOW,
+                                              sizeof(xcb_window_t));
+                const xcb_window_t *wins = lists[r];
+                int n = lens[r] / sizeof *wins;
+                ts[r] = xa_arena_alloc(a, n * sizeof *ts[r]);
+                for (int i = 0; i < n; ++i) {
+                        ts[r][i] = (struct target_search){.win = wins[i]};
+                        xa_spawn_group(&g, consider_target_task, &ts[r][i]);
+                }
+        }
+
+        for (int r = 0; r < nroots; ++r) {
+                xcb_window_t self = 0;
+                xa_get_property_finish(wc[r], XCB_ATOM_WINDOW, 32, &self,
+                                       sizeof(self));
+                if (self != wms[r])
+                        ok = false;
+        }
+        xa_join(&g);
+        if (!ok) {
+                nseen = seen_mark;
+                return false;
+        }
+        for (int r = 0; r < nroots; ++r)
+                for (int i = 0; i < lens[r] / (int)sizeof(xcb_window_t); ++i)
+                        merge_targets(out, &ts[r][i].res);
+        return true;
+}
+
+// Most runs fling to the same Emacs window as the last run.  The
+// target cache records the Emacs windows the last scan found and a
+// hash of the top-level windows of every screen.  If the hash still
+// matches, no windows have come or gone, so re-checking just the
+// recorded windows gives the same answer as a full scan, in the same
+// round trip as checking the hash.
+//
+// A window can also start matching without the root's children
+// changing.  Under a non-reparenting window manager, a withdrawn
+// child of the root gains WM_STATE when it's mapped, so the cache
+// also records the root's children that had no WM_STATE and checks
+// them again.  Matches on the title or desktop can change at any
+// time, so those specs don't use the cache at all.
+struct target_check
+{
+        char *path;
+        xcb_query_tree_cookie_t *qt;
+        bool hashed, hash_ok, hit;
+        uint64_t hash;
+        // The children of each root, once hashed
+        struct window_run *kids;
+
+        // The cached state, if it was loaded
+        bool loaded;
+        uint64_t cached_hash;
+        struct seen_target *wins;
+        int nwins;
+        xcb_window_t *unmanaged;
+        int nunmanaged;
+        xcb_get_property_cookie_t *unmanaged_gp;
+
+        // Checks of the cached windows
+        struct xa_group group;
+        struct target_search *searches;
+};
+
+static int
+window_cmp(const void *a, const void *b)
+{
+        xcb_window_t x = *(const xcb_window_t*)a, y = *(const xcb_window_t*)b;
+        return x < y ? -1 : x > y;
+}
+
+// The cached windows are only the answer for the same match spec.
+static char *
+target_cache_key(void)
+{
+        char *base = cache_key(), *key;
+        asprintf(&key, "%s %s", base, match_plan.spec);
+        free(base);
+        return key;
+}
+
+// Start a WM_STATE check of each of wins.
+static xcb_get_property_cookie_t *
+wm_state_start(const xcb_window_t *wins, int n)
+{
+        xcb_get_property_cookie_t *gp = xa_arena_alloc(&scan_arena,
+                                                       n * sizeof *gp);
+        for (int i = 0; i < n; ++i) {
+                gp[i] = xcb_get_property(conn, false, wins[i], ATOM(WM_STATE),
+                                         XCB_GET_PROPERTY_TYPE_ANY, 0, 0);
+                XA_TRACE_REQ("has_property", gp[i]);
+        }
+        return gp;
+}
+
+// Finish a WM_STATE check.  A window that's gone has no WM_STATE.
+static bool
+wm_state_finish(xcb_get_property_cookie_t gp)
+{
+        xcb_get_property_reply_t *gpr = xa_await(gp.sequence, NULL);
+        bool top = gpr && gpr->type != 0;
+        free(gpr);
+        return top;
+}
+
+// Start a target cache check.  This queries the root windows for the
+// hash and, if use is set, spawns consider_target tasks for the
+// cached windows.
+static void
+target_cache_start(struct target_check *tc, bool use)
+{
+        memset(tc, 0, sizeof *tc);
+        if (match_plan.has_title || match_plan.has_desktop)
+                return;
+        tc->path = cache_path("target");
+        if (!tc->path)
+                return;
+        tc->qt = xa_arena_alloc(&scan_arena, nroots * sizeof *tc->qt);
+        for (int r = 0; r < nroots; ++r) {
+                tc->qt[r] = xcb_query_tree(conn, roots[r]);
+                XA_TRACE_REQ("QueryTree", tc->qt[r]);
+        }
+        if (!use)
+                return;
+
+        FILE *f = fopen(tc->path, "r");
+        if (!f)
+                return;
+        char *key = target_cache_key(), *line = NULL;
+        size_t cap = 0;
+        unsigned long long hash;
+        bool ok = getline(&line, &cap, f) > 0 &&
+                strcspn(line, "\n") == strlen(key) &&
+                strncmp(line, key, strlen(key)) == 0 &&
+                fscanf(f, "%llx %d", &hash, &tc->nwins) == 2 &&
+                tc->nwins >= 0 && tc->nwins <= 65536;
+        if (ok) {
+                tc->wins = xa_arena_alloc(&scan_arena,
+                                          tc->nwins * sizeof *tc->wins);
+                for (int i = 0; ok && i < tc->nwins; ++i)
+                        ok = fscanf(f, "%x %u", &tc->wins[i].win,
+                                    &tc->wins[i].user_time) == 2;
+        }
+        ok = ok && fscanf(f, "%d", &tc->nunmanaged) == 1 &&
+                tc->nunmanaged >= 0 && tc->nunmanaged <= 65536;
+        if (ok) {
+                tc->unmanaged = xa_arena_alloc(&scan_arena, tc->nunmanaged *
+                                               sizeof *tc->unmanaged);
+                for (int i = 0; ok && i < tc->nunmanaged; ++i)
+                        ok = fscanf(f, "%x", &tc->unmanaged[i]) == 1;
+        }
+        free(line);
+        free(key);
+        fclose(f);
+        if (!ok)
+                return;
+        tc->loaded = true;
+        tc->cached_hash = hash;
+        tc->unmanaged_gp = wm_state_start(tc->unmanaged, tc->nunmanaged);
+        tc->searches = xa_arena_alloc(&scan_arena,
+                                      tc->nwins * sizeof *tc->searches);
+        for (int i = 0; i < tc->nwins; ++i) {
+                tc->searches[i] = (struct target_search){
+                        .win = tc->wins[i].win};
+                xa_spawn_group(&tc->group, consider_target_task,
+                               &tc->searches[i]);
+        }
+}
+
+// Hash the children of every root.  Stacking order changes whenever
+// a window is raised, so hash them as a set.
+static void
+target_cache_hash(struct target_check *tc)
+{
+        if (tc->hashed)
+                return;
+        tc->hashed = tc->hash_ok = true;
+        tc->hash = 14695981039346656037ull;
+        tc->kids = xa_arena_alloc(&scan_arena, nroots * sizeof *tc->kids);
+        for (int r = 0; r < nroots; ++r) {
+                tc->kids[r] = (struct window_run){NULL, 0};
+                xcb_query_tree_reply_t *qtr =
+                        xa_arena_own(&scan_arena, xa_await(tc->qt[r].sequence,
+                                                           NULL));
+                if (!qtr) {
+                        tc->hash_ok = false;
+                        continue;
+                }
+                int nc = xcb_query_tree_children_length(qtr);
+                xcb_window_t *sorted = xa_arena_alloc(&scan_arena,
+                                                      nc * sizeof *sorted);
+                memcpy(sorted, xcb_query_tree_children(qtr),
+                       nc * sizeof *sorted);
+                qsort(sorted, nc, sizeof *sorted, window_cmp);
+                tc->kids[r] = (struct window_run){sorted, nc};
+                // FNV-1a
+                const unsigned char *p = (const unsigned char*)sorted;
+                for (size_t i = 0; i < nc * sizeof *sorted; ++i)
+                        tc->hash = (tc->hash ^ p[i]) * 1099511628211ull;
+                tc->hash = (tc->hash ^ 0xff) * 1099511628211ull;
+        }
+}
+
+// Return whether the cached windows are a complete answer, and if
+// so, store it in out.  On a miss, the caller must scan.
+static bool
+target_cache_hit(struct target_check *tc, struct targets *out)
+{
+        if (!tc->loaded)
+                return false;
+        target_cache_hash(tc);
+        xa_join(&tc->group);
+        struct targets res = {};
+        for (int i = 0; i < tc->nwins; ++i)
+                merge_targets(&res, &tc->searches[i].res);
+        bool managed = false;
+        for (int i = 0; i < tc->nunmanaged; ++i)
+                if (wm_state_finish(tc->unmanaged_gp[i]))
+                        managed = true;
+        if (!tc->hash_ok || tc->hash != tc->cached_hash || managed ||
+            !res.found_visible)
+                return false;
+        *out = res;
+        tc->hit = true;
+        return true;
+}
+
+// Record the targets found for the next run and release tc.
+static void
+target_cache_finish(struct target_check *tc)
+{
+        if (!tc->path)
+                return;
+        target_cache_hash(tc);
+
+        // After a hit, only rewrite the cache if something changed.
+        bool changed = !tc->hit || tc->nwins != nseen;
+        for (int i = 0; !changed && i < nseen; ++i)
+                changed = seen[i].win != tc->wins[i].win ||
+                        seen[i].user_time != tc->wins[i].user_time;
+        if (tc->hash_ok && changed) {
+                // After a hit, the root's children are the same and
+                // none of the recorded ones gained WM_STATE.
+                // Otherwise, check them all again.
+                xcb_window_t *unmanaged = tc->unmanaged;
+                int nunmanaged = tc->nunmanaged;
+                if (!tc->hit) {
+                        int nkids = 0;
+                        for (int r = 0; r < nroots; ++r)
+                                nkids += tc->kids[r].n;
+                        unmanaged = xa_arena_alloc(&scan_arena,
+                                                   nkids * sizeof *unmanaged);
+                        nunmanaged = 0;
+                        xcb_get_property_cookie_t **gp = xa_arena_alloc(
+                                &scan_arena, nroots * sizeof *gp);
+                        for (int r = 0; r < nroots; ++r)
+                                gp[r] = wm_state_start(tc->kids[r].wins,
+                                                       tc->kids[r].n);
+                        for (int r = 0; r < nroots; ++r)
+                                for (int i = 0; i < tc->kids[r].n; ++i)
+                                        if (!wm_state_finish(gp[r][i]))
+                                                unmanaged[nunmanaged++] =
+                                                        tc->kids[r].wins[i];
+                }
+
+                char *tmp;
+                asprintf(&tmp, "%s.%d", tc->path, (int)getpid());
+                FILE *f = fopen(tmp, "w");
+                if (f) {
+                        char *key = target_cache_key();
+                        fprintf(f, "%s\n%llx %d\n", key,
+                                (unsigned long long)tc->hash, nseen);
+                        free(key);
+                        for (int i = 0; i < nseen; ++i)
+                                fprintf(f, "%#x %u\n", seen[i].win,
+                                        seen[i].user_time);
+                        fprintf(f, "%d\n", nunmanaged);
+                        for (int i = 0; i < nunmanaged; ++i)
+                                fprintf(f, "%#x\n", unmanaged[i]);
+                        if (fclose(f) == 0)
+                                rename(tmp, tc->path);
+                        else
+                                unlink(tmp);
+                }
+                free(tmp);
+        }
+        free(tc->path);
+        tc->path = NULL;
+}
+
+//////////////////////////////////////////////////////////////////
+// XDND
+//
+// The drop runs as a state machine driven by epoll on the X
+// connection, with a deadline for each phase, so a target that stalls
+// can't hang the caller.  Requests are sent unchecked and their
+// errors are matched up as they arrive in the event stream, so no
+// step of the handshake waits on a round trip of its own.
+
+// Resend XdndPosition if the target hasn't answered in this long.
+#define DND_POSITION_RETRY_MS 250
+// Give up if the target hasn't answered XdndPosition in this long.
+#define DND_STATUS_TIMEOUT_MS 2000
+// Give up if the target goes quiet for this long after XdndDrop.
+#define DND_FINISH_TIMEOUT_MS 10000
+
+// The number of recent requests whose errors we recognize.  Errors
+// arrive within a round trip, and we never have many requests in
+// flight.
+#define DND_CHECKS 64
+
+// An ICCCM INCR selection transfer, for selections too big to send
+// in one request.
+struct incr_transfer
+{
+        xcb_window_t requestor;
+        xcb_atom_t property;
+        const char *data;
+        size_t len, pos;
+        // Set once the zero-length terminator has been sent
+        bool done;
+};
+
+enum dnd_state
+{
+        // Setting up and sending XdndEnter
+        DND_START,
+        // Waiting for XdndStatus in response to XdndPosition
+        DND_WAIT_STATUS,
+        // Dropped; serving the selection until XdndFinished
+        DND_WAIT_FINISHED,
+        DND_DONE,
+};
+
+struct dnd
+{
+        xcb_window_t source, target;
+        const char *uris;
+        enum dnd_state state;
+        // When the current phase times out, and when to resend
+        // XdndPosition, on the xa_trace_now clock
+        uint64_t deadline, retry;
+        // When the current phase started, for tracing
+        uint64_t phase_start;
+
+        struct incr_transfer incr;
+        bool incr_active;
+
+        // Recent requests whose errors are fatal, as a ring
+        struct {
+                unsigned int seq;
+                const char *info;
+        } checks[DND_CHECKS];
+        unsigned int nchecks;
+};
+
+static uint64_t
+ms_from_now(int ms)
+{
+        return xa_trace_now() + ms * 1000000ull;
+}
+
+// Expect no error from request c.  If one arrives, dnd_event fails
+// the drop with info.
+static void
+dnd_check(struct dnd *d, xcb_void_cookie_t c, const char *info)
+{
+        XA_TRACE_REQ(info, c);
+        xa_stats.requests++;
+        d->checks[d->nchecks % DND_CHECKS].seq = c.sequence;
+        d->checks[d->nchecks % DND_CHECKS].info = info;
+        d->nchecks++;
+}
+
+static void
+dnd_send(struct dnd *d, xcb_atom_t type, uint32_t d1, uint32_t d2,
+         uint32_t d3, uint32_t d4, const char *info)
+{
+        xcb_client_message_event_t msg;
+        memset(&msg, 0, sizeof msg);
+        msg.response_type = XCB_CLIENT_MESSAGE;
+        msg.window = d->target;
+        msg.type = type;
+        msg.format = 32;
+        msg.data.data32[0] = d->source;
+        msg.data.data32[1] = d1;
+        msg.data.data32[2] = d2;
+        msg.data.data32[3] = d3;
+        msg.data.data32[4] = d4;
+        dnd_check(d, xcb_send_event(conn, 0, d->target, 0, (char*)&msg),
+                  info);
+}
+
+static void
+dnd_send_position(struct dnd *d)
+{
+        // Emacs blows up if you send position (0,0)
+        dnd_send(d, ATOM(XdndPosition), 0, (1 << 16) | 1, XCB_CURRENT_TIME,
+                 ATOM(XdndActionCopy), "sending XdndPosition event");
+        d->retry = ms_from_now(DND_POSITION_RETRY_MS);
+}
+
+// Abandon the drop.  Until we've dropped, the target is waiting on
+// us, so tell it we're leaving.
+static void
+dnd_fail(struct dnd *d, const char *msg)
+{
+        fprintf(stderr, "%s\n", msg);
+        if (d->state == DND_WAIT_STATUS)
+                dnd_send(d, ATOM(XdndLeave), 0, 0, 0, 0,
+                         "sending XdndLeave event");
+        xcb_flush(conn);
+        exit(1);
+}
+
+static void
+dnd_phase(struct dnd *d, enum dnd_state state, int timeout_ms)
+{
+        static const char *names[] = {"dnd start", "dnd status",
+                                      "dnd finish"};
+        if (d->state < DND_DONE)
+                xa_trace_span(names[d->state], d->phase_start);
+        d->state = state;
+        d->phase_start = xa_trace_now();
+        d->deadline = ms_from_now(timeout_ms);
+}
+
+static size_t
+max_property_data(void)
+{
+        // Maximum request length is in 4 byte units and includes
+        // the ChangeProperty header.  With BIG-REQUESTS, a request
+        // that long also carries an extra 4 byte length field.
+        return xcb_get_maximum_request_length(conn) * 4 -
+                sizeof(xcb_change_property_request_t) - 4;
+}
+
+// Store the selection in the property sev asked for.  If it's too big
+// for one request, start an INCR transfer instead; incr_next sends the
+// data as the requestor deletes each piece.
+static void
+send_selection(struct dnd *d, xcb_selection_request_event_t *sev)
+{
+        size_t len = strlen(d->uris);
+        if (len > max_property_data()) {
+                // We need PropertyNotify from the requestor to see
+                // when it has taken each chunk.
+                uint32_t mask[] = {XCB_EVENT_MASK_PROPERTY_CHANGE};
+                dnd_check(d, xcb_change_window_attributes
+                          (conn, sev->requestor, XCB_CW_EVENT_MASK, mask),
+                          "selecting requestor events");
+                uint32_t size = len;
+                dnd_check(d, xcb_change_property
+                          (conn, XCB_PROP_MODE_REPLACE, sev->requestor,
+                           sev->property, ATOM(INCR), 32, 1, &size),
+                          "returning selection");
+                d->incr = (struct incr_transfer){
+                        sev->requestor, sev->property, d->uris, len, 0, false};
+                d->incr_active = true;
+        } else {
+                dnd_check(d, xcb_change_property
+                          (conn, XCB_PROP_MODE_REPLACE, sev->requestor,
+                           sev->property, XCB_ATOM_STRING, 8, len, d->uris),
+                          "returning selection");
+        }
+
+        xcb_selection_notify_event_t smsg = {};
+        smsg.response_type = XCB_SELECTION_NOTIFY;
+        smsg.time = sev->time;
+        smsg.requestor = sev->requestor;
+        smsg.selection = sev->selection;
+        smsg.target = sev->target;
+        smsg.property = sev->property;
+        dnd_check(d, xcb_send_event(conn, 0, d->target, 0, (char*)&smsg),
+                  "sending selection notify");
+}
+
+// Handle a PropertyNotify during an INCR transfer.  Returns whether
+// the transfer is still in progress.
+static bool
+incr_next(struct dnd *d, xcb_property_notify_event_t *pev)
+{
+        struct incr_transfer *incr = &d->incr;
+        if (pev->window != incr->requestor || pev->atom != incr->property ||
+            pev->state != XCB_PROPERTY_DELETE)
+                return true;
+        if (incr->done) {
+                uint32_t mask[] = {0};
+                xcb_change_window_attributes(conn, incr->requestor,
+                                             XCB_CW_EVENT_MASK, mask);
+                return false;
+        }
+
+        // Each piece is appended after the requestor deletes the
+        // last; an empty piece ends the transfer.
+        size_t n = incr->len - incr->pos;
+        if (n > max_property_data())
+                n = max_property_data();
+        dnd_check(d, xcb_change_property
+                  (conn, XCB_PROP_MODE_REPLACE, incr->requestor,
+                   incr->property, XCB_ATOM_STRING, 8, n,
+                   incr->data + incr->pos),
+                  "sending INCR chunk");
+        incr->pos += n;
+        if (n == 0)
+                incr->done = true;
+        return true;
+}
+
+static void
+dnd_event(struct dnd *d, xcb_generic_event_t *ev)
+{
+        xcb_client_message_event_t *cev = (xcb_client_message_event_t*)ev;
+        xcb_selection_request_event_t *sev =
+                (xcb_selection_request_event_t*)ev;
+        int typ = ev->response_type & XCB_EVENT_RESPONSE_TYPE_MASK;
+
+        if (typ == 0) {
+                xcb_generic_error_t *err = (xcb_generic_error_t*)ev;
+                for (int i = 0; i < DND_CHECKS; ++i) {
+                        if (d->checks[i].info &&
+                            d->checks[i].seq == err->full_sequence) {
+                                char *msg;
+                                asprintf(&msg, "X error %s: %s",
+                                         d->checks[i].info,
+                                         xcb_event_get_error_label
+                                         (err->error_code));
+                                dnd_fail(d, msg);
+                        }
+                }
+                fprintf(stderr, "Ignoring X error %s\n",
                         xcb_event_get_error_label(err->error_code));
-                free(err);
-                exit(1);
+        } else if (typ == XCB_CLIENT_MESSAGE && cev->type == ATOM(XdndStatus)) {
+                // A retransmitted XdndPosition can get more than one
+                // answer.
+                if (d->state != DND_WAIT_STATUS)
+                        return;
+                if (!(cev->data.data32[1] & 1))
+                        dnd_fail(d, "Target not accepting drag-and-drop");
+                dnd_send(d, ATOM(XdndDrop), 0, XCB_CURRENT_TIME, 0, 0,
+                         "sending XdndDrop event");
+                dnd_phase(d, DND_WAIT_FINISHED, DND_FINISH_TIMEOUT_MS);
+
+                // XXX Use WM_TAKE_FOCUS
+                xcb_window_t target = d->target;
+                uint32_t conf[] = {XCB_STACK_MODE_ABOVE};
+                xcb_configure_window(conn, target,
+                                     XCB_CONFIG_WINDOW_STACK_MODE, conf);
+                xcb_set_input_focus(conn, XCB_INPUT_FOCUS_POINTER_ROOT,
+                                    target, XCB_CURRENT_TIME);
+                // XXX Terrible.  Without this xmonad doesn't
+                // realize the focus changed.
+                // XXX Move mouse to middle?
+                xcb_warp_pointer(conn, XCB_WINDOW_NONE, screen->root,
+                                 0, 0, 0, 0, 0, 0);
+                xcb_warp_pointer(conn, XCB_WINDOW_NONE, target,
+                                 0, 0, 0, 0, 10, 10);
+        } else if (typ == XCB_SELECTION_REQUEST) {
+                if (sev->selection != ATOM(XdndSelection)) {
+                        fprintf(stderr, "Request for unknown selection %d\n",
+                                sev->selection);
+                        return;
+                }
+                if (sev->target != ATOM(textUriList)) {
+                        fprintf(stderr, "Request for unknown target type %d\n",
+                                sev->target);
+                        return;
+                }
+                if (sev->property == 0)
+                        dnd_fail(d, "Old-style selection protocol not supported");
+                send_selection(d, sev);
+                d->deadline = ms_from_now(DND_FINISH_TIMEOUT_MS);
+        } else if (typ == XCB_PROPERTY_NOTIFY) {
+                if (d->incr_active) {
+                        d->incr_active = incr_next
+                                (d, (xcb_property_notify_event_t*)ev);
+                        d->deadline = ms_from_now(DND_FINISH_TIMEOUT_MS);
+                }
+        } else if (typ == XCB_CLIENT_MESSAGE &&
+                   cev->type == ATOM(XdndFinished)) {
+                dnd_phase(d, DND_DONE, 0);
+        } else {
+                fprintf(stderr, "Received unexpected event type %d\n",
+                        ev->response_type);
         }
 }
 
 void
-do_dnd(xcb_window_t target, const char *paste)
-{
-        xcb_window_t source = xcb_generate_id(conn);
-        xcb_void_cookie_t v;
-
-        xcb_atom_t XdndAware, XdndSelection,
-                XdndEnter, XdndPosition, XdndStatus, XdndDrop, XdndFinished,
-                textUriList, XdndActionCopy;
-        XCB_ASYNC {XdndAware = ATOM("XdndAware");}
-        XCB_ASYNC {XdndSelection = ATOM("XdndSelection");}
-        XCB_ASYNC {XdndEnter = ATOM("XdndEnter");}
-        XCB_ASYNC {XdndPosition = ATOM("XdndPosition");}
-        XCB_ASYNC {XdndStatus = ATOM("XdndStatus");}
-        XCB_ASYNC {XdndDrop = ATOM("XdndDrop");}
-        XCB_ASYNC {XdndFinished = ATOM("XdndFinished");}
-        XCB_ASYNC {textUriList = ATOM("text/uri-list");}
-        XCB_ASYNC {XdndActionCopy = ATOM("XdndActionCopy");}
-        // The following requires knowing that all of the above do at
-        // most one xcb_wait, as do the other synchronizing xcb_wait's.
-        xcb_wait();
-
-        // Check for XDND target support
-        int version = atom_property(target, XdndAware);
+do_dnd(xcb_window_t target, const char *uris)
+{
+        struct dnd d = {.target = target, .uris = uris, .state = DND_START,
+                        .phase_start = xa_trace_now()};
+        d.source = xcb_generate_id(conn);
+
+        // Create the XDND source window, take the selection, and
+        // check for XDND target support, all in one round trip.
+        dnd_check(&d, xcb_create_window
+                  (conn, 0, d.source, screen->root,
+                   0, 0, 1, 1, 0, XCB_WINDOW_CLASS_INPUT_ONLY,
+                   screen->root_visual, 0, NULL),
+                  "creating DND source window");
+        dnd_check(&d, xcb_set_selection_owner
+                  (conn, d.source, ATOM(XdndSelection), XCB_CURRENT_TIME),
+                  "setting selection owner");
+        xcb_get_property_cookie_t aware =
+                xa_get_property_start(target, ATOM(XdndAware), XCB_ATOM_ATOM,
+                                      sizeof(xcb_atom_t));
+        uint32_t version = 0;
+        xa_get_property_finish(aware, XCB_ATOM_ATOM, 32, &version,
+                               sizeof version);
         if (!version) {
                 fprintf(stderr, "Target window does not support drag-and-drop\n");
                 exit(1);
@@ -332,181 +1483,472 @@ do_dnd(xcb_window_t target, const char *paste)
         if (version > 5)
                 version = 5;
 
-        // Create XDND source window
-        XCB_ASYNC {
-                v = xcb_create_window_checked
-                        (conn, 0, source, screen->root,
-                         0, 0, 1, 1, 0, XCB_WINDOW_CLASS_INPUT_ONLY,
-                         screen->root_visual, 0, NULL);
-                xcb_wait_and_check(v, "creating DND source window");
-        }
-        XCB_ASYNC {
-                v = xcb_set_selection_owner_checked
-                        (conn, source, XdndSelection,
-                         XCB_CURRENT_TIME);
-                xcb_wait_and_check(v, "setting selection owner");
-        }
-        xcb_wait();
-
-        // Send enter event
-        XCB_ASYNC {
-                xcb_client_message_event_t msg;
-                memset(&msg, 0, sizeof msg);
-                msg.response_type = XCB_CLIENT_MESSAGE;
-                msg.window = target;
-                msg.type = XdndEnter;
-                msg.format = 32;
-                msg.data.data32[0] = source;
-                msg.data.data32[1] = version << 24;
-                msg.data.data32[2] = textUriList;
-                v = xcb_send_event_checked(conn, 0, target, 0, (char*)&msg);
-                xcb_wait_and_check(v, "Sending XdndEnter event");
-        }
-        // Send position event
-        XCB_ASYNC {
-                xcb_client_message_event_t msg;
-                memset(&msg, 0, sizeof msg);
-                msg.response_type = XCB_CLIENT_MESSAGE;
-                msg.window = target;
-                msg.type = XdndPosition;
-                msg.format = 32;
-                msg.data.data32[0] = source;
-                msg.data.data32[1] = 0;
-                // Emacs blows up if you send position (0,0)
-                msg.data.data32[2] = (1 << 16) | 1;
-                msg.data.data32[3] = XCB_CURRENT_TIME;
-                msg.data.data32[4] = XdndActionCopy;
-                v = xcb_send_event_checked(conn, 0, target, 0, (char*)&msg);
-                xcb_wait_and_check(v, "Sending XdndPosition event");
-        }
-        xcb_wait();
-
-        // Event loop
-        while (1) {
-                // XXX Timeout
-                xcb_generic_event_t *ev = xcb_wait_for_event(conn);
-                xcb_client_message_event_t *cev =
-                        (xcb_client_message_event_t*)ev;
-                xcb_selection_request_event_t *sev =
-                        (xcb_selection_request_event_t*)ev;
-                int typ = ev->response_type & XCB_EVENT_RESPONSE_TYPE_MASK;
-
-                if (typ == XCB_CLIENT_MESSAGE &&
-                    cev->type == XdndStatus) {
-                        if (!(cev->data.data32[1] & 1)) {
-                                // XXX Send XdndLeave
-                                fprintf(stderr, "Target not accepting drag-and-drop\n");
-                                exit(1);
-                        }
-                        // Send drop
-                        xcb_client_message_event_t msg;
-                        memset(&msg, 0, sizeof msg);
-                        msg.response_type = XCB_CLIENT_MESSAGE;
-                        msg.window = target;
-                        msg.type = XdndDrop;
-                        msg.format = 32;
-                        msg.data.data32[0] = source;
-                        msg.data.data32[1] = 0;
-                        msg.data.data32[2] = XCB_CURRENT_TIME;
-                        v = xcb_send_event_checked(conn, 0, target, 0, (char*)&msg);
-                        xcb_wait_and_check(v, "Sending XdndDrop event");
-
-                        // XXX Use WM_TAKE_FOCUS
-                        uint32_t conf[] = {XCB_STACK_MODE_ABOVE};
-                        xcb_configure_window(conn, target,
-                                             XCB_CONFIG_WINDOW_STACK_MODE,
-                                             conf);
-                        xcb_set_input_focus(conn, XCB_INPUT_FOCUS_POINTER_ROOT,
-                                            target, XCB_CURRENT_TIME);
-                        // XXX Terrible.  Without this xmonad doesn't
-                        // realize the focus changed.
-                        // XXX Move mouse to middle?
-                        xcb_warp_pointer(conn, XCB_WINDOW_NONE, screen->root,
-                                         0, 0, 0, 0, 0, 0);
-                        xcb_warp_pointer(conn, XCB_WINDOW_NONE, target,
-                                         0, 0, 0, 0, 10, 10);
-                } else if (typ == XCB_SELECTION_REQUEST) {
-                        if (sev->selection != XdndSelection) {
-                                fprintf(stderr,
-                                        "Request for unknown selection %d\n",
-                                        sev->selection);
-                                continue;
-                        }
-                        if (sev->target != textUriList) {
-                                fprintf(stderr,
-                                        "Request for unknown target type %d\n",
-                                        sev->target);
-                                continue;
-                        }
-                        if (sev->property == 0) {
-                                fprintf(stderr,
-                                        "Old-style selection protocol not supported\n");
-                                exit(1);
-                        }
+        dnd_send(&d, ATOM(XdndEnter), version << 24, ATOM(textUriList), 0, 0,
+                 "sending XdndEnter event");
+        dnd_send_position(&d);
+        dnd_phase(&d, DND_WAIT_STATUS, DND_STATUS_TIMEOUT_MS);
 
-                        // Expand paste to an file-DND-friendly URI.
-                        // This is subtler than it looks.  We pass a
-                        // "local" path, even if we actually want a
-                        // "remote" (say, Tramp) path.  Remote paths
-                        // are opened using url-handler-mode, which
-                        // will use FTP.  So, to get Emacs' usual path
-                        // handling, we pass a "local" path, so that
-                        // dnd-open-file just strips the file:// part,
-                        // and then invokes the usual
-                        // file-name-handler-alist mechanism.
-                        char *uri;
-                        asprintf(&uri, "file://%s", paste);
-                        // Respond with selection contents
-                        XCB_ASYNC {
-                                v = xcb_change_property_checked
-                                        (conn, XCB_PROP_MODE_REPLACE, sev->requestor,
-                                         sev->property, XCB_ATOM_STRING, 8,
-                                         strlen(uri), uri);
-                                xcb_wait_and_check(v, "returning selection");
-                        }
-                        XCB_ASYNC {
-                                xcb_selection_notify_event_t smsg = {};
-                                smsg.response_type = XCB_SELECTION_NOTIFY;
-                                smsg.time = sev->time;
-                                smsg.requestor = sev->requestor;
-                                smsg.selection = sev->selection;
-                                smsg.target = sev->target;
-                                smsg.property = sev->property;
-                                v = xcb_send_event_checked(conn, 0, target, 0, (char*)&smsg);
-                                xcb_wait_and_check(v, "sending selection notify");
-                        }
-                        xcb_wait();
-                        free(uri);
-                } else if (typ == XCB_CLIENT_MESSAGE &&
-                           cev->type == XdndFinished) {
+        int ep = epoll_create1(EPOLL_CLOEXEC);
+        struct epoll_event xev = {.events = EPOLLIN};
+        if (ep < 0 || epoll_ctl(ep, EPOLL_CTL_ADD,
+                                xcb_get_file_descriptor(conn), &xev) < 0)
+                panic("epoll setup failed");
+
+        while (1) {
+                xcb_generic_event_t *ev;
+                while (d.state != DND_DONE && (ev = xcb_poll_for_event(conn))) {
+                        dnd_event(&d, ev);
+                        free(ev);
+                }
+                if (d.state == DND_DONE)
                         break;
-                } else {
-                        fprintf(stderr,
-                                "Received unexpected event type %d\n",
-                                ev->response_type);
+                if (xcb_connection_has_error(conn))
+                        dnd_fail(&d, "X connection failed");
+
+                uint64_t now = xa_trace_now(), wake = d.deadline;
+                if (now >= d.deadline)
+                        dnd_fail(&d, d.state == DND_WAIT_STATUS ?
+                                 "Timed out waiting for XdndStatus" :
+                                 "Timed out waiting for XdndFinished");
+                if (d.state == DND_WAIT_STATUS) {
+                        if (now >= d.retry)
+                                dnd_send_position(&d);
+                        if (d.retry < wake)
+                                wake = d.retry;
                 }
+                xcb_flush(conn);
+                int timeout = (wake - now + 999999) / 1000000;
+                if (epoll_wait(ep, &xev, 1, timeout) < 0 && errno != EINTR)
+                        panic("epoll_wait failed");
         }
+        close(ep);
 }
 
-char *
-parse_args(int argc, char **argv)
+//////////////////////////////////////////////////////////////////
+// Daemon
+//
+// fling -d stays connected to the X server and keeps a table of Emacs
+// top-level windows up to date from StructureNotify and
+// PropertyNotify events.  Other fling invocations ask it for the
+// target over a Unix socket instead of scanning the tree.
+
+struct daemon_window
+{
+        xcb_window_t win;
+        // The window carrying win's user time, or 0 if it's win
+        xcb_window_t time_win;
+        bool viewable;
+        uint32_t user_time;
+};
+
+static struct daemon_window *daemon_windows;
+static int daemon_nwindows, daemon_cap;
+
+static struct daemon_window *
+daemon_find(xcb_window_t win)
 {
+        for (int i = 0; i < daemon_nwindows; ++i)
+                if (daemon_windows[i].win == win)
+                        return &daemon_windows[i];
+        return NULL;
+}
+
+// Find the window whose user time lives on time_win.
+static struct daemon_window *
+daemon_find_time_win(xcb_window_t time_win)
+{
+        for (int i = 0; i < daemon_nwindows; ++i)
+                if (daemon_windows[i].time_win == time_win)
+                        return &daemon_windows[i];
+        return NULL;
+}
+
+void
+daemon_update(xcb_window_t win, xcb_window_t time_win, bool viewable,
+              uint32_t user_time)
+{
+        struct daemon_window *dw = daemon_find(win);
+        if (!dw) {
+                if (daemon_nwindows == daemon_cap) {
+                        daemon_cap = daemon_cap ? 2 * daemon_cap : 16;
+                        daemon_windows = realloc(daemon_windows,
+                                                 daemon_cap * sizeof *dw);
+                        if (!daemon_windows)
+                                panic("failed to realloc daemon windows");
+                }
+                dw = &daemon_windows[daemon_nwindows++];
+                dw->win = win;
+                dw->time_win = 0;
+                // Track the window's own map state and properties
+                uint32_t mask[] = {XCB_EVENT_MASK_STRUCTURE_NOTIFY |
+                                   XCB_EVENT_MASK_PROPERTY_CHANGE};
+                xcb_change_window_attributes(conn, win, XCB_CW_EVENT_MASK,
+                                             mask);
+        }
+        // If win carries its own user time, it's already selected for
+        // property changes, and replacing its mask would lose its map
+        // state.
+        if (time_win && time_win != dw->time_win && time_win != win) {
+                uint32_t mask[] = {XCB_EVENT_MASK_PROPERTY_CHANGE};
+                xcb_change_window_attributes(conn, time_win,
+                                             XCB_CW_EVENT_MASK, mask);
+        }
+        dw->time_win = time_win;
+        dw->viewable = viewable;
+        dw->user_time = user_time;
+}
+
+static void
+daemon_remove(xcb_window_t win)
+{
+        struct daemon_window *dw = daemon_find(win);
+        if (dw)
+                *dw = daemon_windows[--daemon_nwindows];
+}
+
+// win doesn't match, or no longer does.  A window's title and desktop
+// can change at any time, so if the plan tests those, keep watching
+// its properties to notice when it starts matching.
+void
+daemon_reject(xcb_window_t win)
+{
+        daemon_remove(win);
+        if (match_plan.has_title || match_plan.has_desktop) {
+                uint32_t mask[] = {XCB_EVENT_MASK_PROPERTY_CHANGE};
+                xcb_change_window_attributes(conn, win, XCB_CW_EVENT_MASK,
+                                             mask);
+        }
+}
+
+// Run task on win in the background.  Nothing reads its result, so
+// the search lives on the task's own stack.
+static void
+daemon_spawn(void (*task)(void*), xcb_window_t win)
+{
+        struct target_search ts = {.win = win};
+        XA_SPAWN_COPY(NULL, task, ts);
+}
+
+static void
+daemon_event(xcb_generic_event_t *ev)
+{
+        int typ = ev->response_type & XCB_EVENT_RESPONSE_TYPE_MASK;
+        switch (typ) {
+        case XCB_MAP_NOTIFY: {
+                xcb_map_notify_event_t *mev = (xcb_map_notify_event_t*)ev;
+                if (is_root(mev->event))
+                        // A new (or re-shown) top-level frame.  Look
+                        // for clients in it.
+                        daemon_spawn(get_top_level_windows_task,
+                                     mev->window);
+                else if (daemon_find(mev->window))
+                        daemon_spawn(consider_target_task, mev->window);
+                break;
+        }
+        case XCB_UNMAP_NOTIFY: {
+                xcb_unmap_notify_event_t *uev = (xcb_unmap_notify_event_t*)ev;
+                if (is_root(uev->event)) {
+                        // Unmapping a frame makes its client
+                        // unviewable without telling the client.
+                        // There are few Emacs windows, so just
+                        // refresh them all.
+                        for (int i = 0; i < daemon_nwindows; ++i)
+                                daemon_spawn(consider_target_task,
+                                             daemon_windows[i].win);
+                } else if (daemon_find(uev->window)) {
+                        daemon_spawn(consider_target_task, uev->window);
+                }
+                break;
+        }
+        case XCB_DESTROY_NOTIFY: {
+                xcb_destroy_notify_event_t *dev =
+                        (xcb_destroy_notify_event_t*)ev;
+                daemon_remove(dev->window);
+                break;
+        }
+        case XCB_PROPERTY_NOTIFY: {
+                xcb_property_notify_event_t *pev =
+                        (xcb_property_notify_event_t*)ev;
+                struct daemon_window *dw = daemon_find(pev->window);
+                if (pev->atom == ATOM(_NET_WM_USER_TIME)) {
+                        if (!dw)
+                                dw = daemon_find_time_win(pev->window);
+                        if (dw)
+                                daemon_spawn(consider_target_task, dw->win);
+                } else if (match_watches(pev->atom) &&
+                           (dw || !daemon_find_time_win(pev->window))) {
+                        // The window may have started or stopped
+                        // matching.  consider_target adds or removes
+                        // it.
+                        daemon_spawn(consider_target_task, pev->window);
+                }
+                break;
+        }
+        case 0: {
+                // Errors from windows that disappeared under us are
+                // expected.
+                xcb_generic_error_t *err = (xcb_generic_error_t*)ev;
+                if (err->error_code != XCB_WINDOW)
+                        fprintf(stderr, "X error: %s\n",
+                                xcb_event_get_error_label(err->error_code));
+                break;
+        }
+        }
+}
+
+// Return the path of the daemon's socket for the current display.
+static char *
+daemon_socket_path(void)
+{
+        const char *display = getenv("DISPLAY");
+        if (!display || !*display)
+                return NULL;
         char *path;
-        char *cwd = get_current_dir_name();
-        if (argc == 1) {
-                path = strdup(cwd);
-        } else if (argc == 2) {
-                if (argv[1][0] == '/')
-                        path = strdup(argv[1]);
-                else if (strcmp(argv[1], ".") == 0)
-                        path = strdup(cwd);
+        const char *dir = getenv("XDG_RUNTIME_DIR");
+        if (dir && *dir)
+                asprintf(&path, "%s/fling.%s", dir, display);
+        else
+                asprintf(&path, "/tmp/fling-%d.%s", (int)getuid(), display);
+        // Displays like "localhost:10.0" are fine, but
+        // "/tmp/launch-xyz/org.xquartz:0" needs flattening.
+        char *base = strrchr(path, '/') + 1;
+        for (char *p = base; *p; ++p)
+                if (*p == '/')
+                        *p = '_';
+        return path;
+}
+
+static void
+daemon_serve(int lfd)
+{
+        int fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0)
+                return;
+        // Don't let a wedged client stall the daemon.
+        struct timeval tv = {.tv_sec = 0, .tv_usec = 100 * 1000};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+
+        // Requests are "target <match spec>\n".  We can only answer
+        // for the spec we were started with.
+        char req[MATCH_MAX_STRING];
+        ssize_t n = read(fd, req, sizeof req - 1);
+        if (n <= 0) {
+                close(fd);
+                return;
+        }
+        req[n] = 0;
+        char resp[64];
+        if (strncmp(req, "target ", 7) != 0 || req[n-1] != '\n') {
+                snprintf(resp, sizeof resp, "error\n");
+        } else if (strlen(req + 7) != strlen(match_plan.spec) + 1 ||
+                   strncmp(req + 7, match_plan.spec,
+                           strlen(match_plan.spec)) != 0) {
+                snprintf(resp, sizeof resp, "mismatch\n");
+        } else {
+                struct daemon_window *best = NULL;
+                for (int i = 0; i < daemon_nwindows; ++i) {
+                        struct daemon_window *dw = &daemon_windows[i];
+                        if (dw->viewable &&
+                            (!best || !best->user_time ||
+                             dw->user_time > best->user_time))
+                                best = dw;
+                }
+                if (best)
+                        snprintf(resp, sizeof resp, "%#x\n", best->win);
+                else if (daemon_nwindows)
+                        snprintf(resp, sizeof resp, "hidden\n");
                 else
-                        asprintf(&path, "%s/%s", cwd, argv[1]);
+                        snprintf(resp, sizeof resp, "none\n");
+        }
+        write(fd, resp, strlen(resp));
+        close(fd);
+}
+
+void
+run_daemon(void)
+{
+        char *path = daemon_socket_path();
+        if (!path) {
+                fprintf(stderr, "DISPLAY is not set\n");
+                exit(1);
+        }
+        int lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        struct sockaddr_un addr = {.sun_family = AF_UNIX};
+        if (lfd < 0 || strlen(path) >= sizeof addr.sun_path) {
+                fprintf(stderr, "Cannot create socket %s\n", path);
+                exit(1);
+        }
+        strcpy(addr.sun_path, path);
+        unlink(path);
+        mode_t old = umask(077);
+        if (bind(lfd, (struct sockaddr*)&addr, sizeof addr) < 0 ||
+            listen(lfd, 16) < 0) {
+                perror(path);
+                exit(1);
+        }
+        umask(old);
+
+        daemon_mode = true;
+        uint32_t mask[] = {XCB_EVENT_MASK_SUBSTRUCTURE_NOTIFY};
+        // Select events before the initial scan so we can't miss
+        // changes that race with it.
+        for (int i = 0; i < nroots; ++i) {
+                xcb_change_window_attributes(conn, roots[i],
+                                             XCB_CW_EVENT_MASK, mask);
+                daemon_spawn(get_top_level_windows_task, roots[i]);
+        }
+        xa_drain();
+        xa_arena_release(&scan_arena);
+
+        while (1) {
+                // Handle everything that's queued up, then let the
+                // resulting tasks run to completion, which may queue
+                // up more events.
+                xcb_generic_event_t *ev;
+                bool any = false;
+                while ((ev = xcb_poll_for_event(conn))) {
+                        daemon_event(ev);
+                        free(ev);
+                        any = true;
+                }
+                if (any) {
+                        xa_drain();
+                        xa_arena_release(&scan_arena);
+                        continue;
+                }
+                if (xcb_connection_has_error(conn)) {
+                        fprintf(stderr, "X connection closed\n");
+                        unlink(path);
+                        exit(1);
+                }
+
+                xcb_flush(conn);
+                struct pollfd pfd[2] = {
+                        {.fd = xcb_get_file_descriptor(conn), .events = POLLIN},
+                        {.fd = lfd, .events = POLLIN},
+                };
+                if (poll(pfd, 2, -1) < 0 && errno != EINTR)
+                        panic("poll failed");
+                if (pfd[1].revents & POLLIN)
+                        daemon_serve(lfd);
+        }
+}
+
+// Ask a running daemon for the target window.  Returns false if
+// there's no daemon for this display, in which case we have to scan.
+bool
+ask_daemon(struct targets *out)
+{
+        char *path = daemon_socket_path();
+        if (!path)
+                return false;
+        struct sockaddr_un addr = {.sun_family = AF_UNIX};
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        bool ok = false;
+        if (fd < 0 || strlen(path) >= sizeof addr.sun_path)
+                goto out;
+        strcpy(addr.sun_path, path);
+        if (connect(fd, (struct sockaddr*)&addr, sizeof addr) < 0)
+                goto out;
+        // A stopped or wedged daemon shouldn't hang us; we can always
+        // scan instead.
+        struct timeval tv = {.tv_sec = 0, .tv_usec = 500 * 1000};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+        char *req;
+        int len = asprintf(&req, "target %s\n", match_plan.spec);
+        bool sent = write(fd, req, len) == len;
+        free(req);
+        if (!sent)
+                goto out;
+        char resp[64];
+        ssize_t n = read(fd, resp, sizeof resp - 1);
+        if (n <= 0)
+                goto out;
+        resp[n] = 0;
+
+        ok = true;
+        if (strcmp(resp, "none\n") == 0) {
+        } else if (strcmp(resp, "hidden\n") == 0) {
+                out->found_some = true;
+        } else if ((out->best_window = strtoul(resp, NULL, 16))) {
+                out->found_some = out->found_visible = true;
         } else {
-                printf("usage: %s [path]", argv[0]);
-                exit(2);
+                ok = false;
         }
-        free(cwd);
+
+out:
+        if (fd >= 0)
+                close(fd);
+        free(path);
+        return ok;
+}
+
+enum scan_engine
+{
+        // _NET_CLIENT_LIST if available, otherwise SCAN_TASKS
+        SCAN_AUTO,
+        // Only _NET_CLIENT_LIST (get_client_list_windows)
+        SCAN_CLIENTS,
+        // One task per window, descending as replies arrive
+        SCAN_TASKS,
+        // Level-at-a-time batches (get_top_level_windows_bfs)
+        SCAN_BFS,
+};
+
+static enum scan_engine scan_engine = SCAN_AUTO;
+
+// With -j, the top-level windows of all screens are dealt out to
+// this many threads, each with its own X connection.  The server
+// handles each connection separately, and reply parsing runs on
+// multiple cores.
+static int scan_jobs = 1;
+
+void
+usage(const char *argv0)
+{
+        printf("usage: %s [-m spec] [-s auto|clients|tasks|bfs] [-j jobs] [-t trace.json] [path...|-]\n"
+               "       %s -d [-m spec]\n"
+               "spec is a comma-separated list of instance=GLOB, class=GLOB,\n"
+               "title=REGEX, pid=N and desktop=N (default " MATCH_DEFAULT ")\n",
+               argv0, argv0);
+        exit(2);
+}
+
+// Write path to out, percent-encoding every byte that can't appear
+// literally in a URI path (RFC 3986).
+static void
+put_uri_path(FILE *out, const char *path)
+{
+        for (const unsigned char *p = (const unsigned char*)path; *p; ++p) {
+                if ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') ||
+                    (*p >= '0' && *p <= '9') ||
+                    strchr("/-._~!$&'()*+,;=:@", *p))
+                        fputc(*p, out);
+                else
+                        fprintf(out, "%%%02X", *p);
+        }
+}
+
+// Append arg, relative to cwd, to the uri-list out.
+//
+// This is subtler than it looks.  We pass a "local" path, even if we
+// actually want a "remote" (say, Tramp) path.  Remote paths are opened
+// using url-handler-mode, which will use FTP.  So, to get Emacs' usual
+// path handling, we pass a "local" path, so that dnd-open-file just
+// strips the file:// part, and then invokes the usual
+// file-name-handler-alist mechanism.
+static void
+add_uri(FILE *out, const char *cwd, const char *arg)
+{
+        char *path;
+        if (arg[0] == '/')
+                path = strdup(arg);
+        else if (strcmp(arg, ".") == 0)
+                path = strdup(cwd);
+        else
+                asprintf(&path, "%s/%s", cwd, arg);
 
         // X-forwarded paths
         // XXX Make this configurable
@@ -525,50 +1967,375 @@ parse_args(int argc, char **argv)
                 free(oldpath);
         }
 
-        return path;
+        fputs("file://", out);
+        put_uri_path(out, path);
+        fputs("\r\n", out);
+        free(path);
+}
+
+// Parse FLING_STACK_SIZE, rounding it up to a whole number of pages.
+static size_t
+parse_stack_size(const char *str)
+{
+        char *end;
+        errno = 0;
+        unsigned long size = strtoul(str, &end, 0);
+        if (errno || end == str || *end || str[0] == '-') {
+                fprintf(stderr, "Bad FLING_STACK_SIZE: %s\n", str);
+                exit(2);
+        }
+        if (size < XA_TASK_STACK_MIN) {
+                fprintf(stderr, "FLING_STACK_SIZE must be at least %d\n",
+                        XA_TASK_STACK_MIN);
+                exit(2);
+        }
+        size_t page = sysconf(_SC_PAGESIZE);
+        if (size > SIZE_MAX - page) {
+                fprintf(stderr, "FLING_STACK_SIZE too large: %s\n", str);
+                exit(2);
+        }
+        return (size + page - 1) / page * page;
+}
+
+char *
+parse_args(int argc, char **argv)
+{
+        int opt;
+        const char *match = MATCH_DEFAULT;
+        while ((opt = getopt(argc, argv, "dj:m:s:t:")) != -1) {
+                switch (opt) {
+                case 'd':
+                        daemon_mode = true;
+                        break;
+                case 'm':
+                        match = optarg;
+                        break;
+                case 's':
+                        if (strcmp(optarg, "auto") == 0)
+                                scan_engine = SCAN_AUTO;
+                        else if (strcmp(optarg, "clients") == 0)
+                                scan_engine = SCAN_CLIENTS;
+                        else if (strcmp(optarg, "tasks") == 0)
+                                scan_engine = SCAN_TASKS;
+                        else if (strcmp(optarg, "bfs") == 0)
+                                scan_engine = SCAN_BFS;
+                        else
+                                usage(argv[0]);
+                        break;
+                case 'j':
+                        scan_jobs = atoi(optarg);
+                        if (scan_jobs < 1)
+                                usage(argv[0]);
+                        break;
+                case 't':
+                        xa_trace_init(optarg);
+                        break;
+                default:
+                        usage(argv[0]);
+                }
+        }
+        compile_match(match);
+
+        // Build a text/uri-list of every path.  "-" reads paths from
+        // stdin, one per line.
+        char *uris;
+        size_t urislen;
+        FILE *out = open_memstream(&uris, &urislen);
+        if (!out)
+                panic("open_memstream failed");
+        char *cwd = get_current_dir_name();
+        if (optind == argc)
+                add_uri(out, cwd, ".");
+        for (int i = optind; i < argc; ++i) {
+                if (strcmp(argv[i], "-") != 0) {
+                        add_uri(out, cwd, argv[i]);
+                        continue;
+                }
+                char *line = NULL;
+                size_t cap = 0;
+                while (getline(&line, &cap, stdin) > 0) {
+                        line[strcspn(line, "\r\n")] = 0;
+                        if (line[0])
+                                add_uri(out, cwd, line);
+                }
+                free(line);
+        }
+        free(cwd);
+        if (fclose(out) != 0)
+                panic("building uri-list failed");
+        if (urislen == 0) {
+                fprintf(stderr, "No paths given\n");
+                exit(1);
+        }
+        return uris;
+}
+
+// Walk the trees under wins using the selected walker.
+static void
+walk_windows(xcb_window_t *wins, int nwins, struct targets *out)
+{
+        if (scan_engine == SCAN_BFS)
+                get_top_level_windows_bfs(wins, nwins, out);
+        else
+                search_windows(get_top_level_windows_task, wins, nwins, out);
+}
+
+struct scan_job
+{
+        pthread_t thread;
+        int index;
+        xcb_window_t *wins;
+        int nwins;
+
+        // Set if the thread couldn't open its own connection
+        bool failed;
+        // The thread's results, seen targets and statistics
+        struct targets res;
+        struct seen_target *seen;
+        int nseen;
+        struct xa_stats stats;
+};
+
+static void *
+scan_worker(void *opaque)
+{
+        struct scan_job *job = opaque;
+        xa_trace_set_pid(job->index + 1);
+        conn = xcb_connect(NULL, NULL);
+        if (xcb_connection_has_error(conn)) {
+                // The main thread will scan our share instead.
+                xcb_disconnect(conn);
+                job->failed = true;
+                return NULL;
+        }
+        xa_init(conn);
+        walk_windows(job->wins, job->nwins, &job->res);
+        xa_arena_release(&scan_arena);
+        job->seen = seen;
+        job->nseen = nseen;
+        job->stats = xa_stats;
+        xcb_disconnect(conn);
+        return NULL;
+}
+
+static void
+walk_windows_parallel(struct targets *out)
+{
+        // Get the top-level windows of every screen in one batch.
+        struct xa_arena *a = &scan_arena;
+        xcb_query_tree_cookie_t *qt = xa_arena_alloc(a, nroots * sizeof *qt);
+        for (int r = 0; r < nroots; ++r) {
+                qt[r] = xcb_query_tree(conn, roots[r]);
+                XA_TRACE_REQ("QueryTree", qt[r]);
+        }
+        xcb_query_tree_reply_t **qtr = xa_arena_alloc(a, nroots * sizeof *qtr);
+        int total = 0;
+        for (int r = 0; r < nroots; ++r) {
+                qtr[r] = xa_arena_own(a, xa_await(qt[r].sequence, NULL));
+                if (qtr[r])
+                        total += xcb_query_tree_children_length(qtr[r]);
+        }
+
+        // Deal them out round-robin.  Window managers put each client
+        // in a frame of its own, so the subtrees are similar in size.
+        int njobs = scan_jobs < total ? scan_jobs : total;
+        if (njobs == 0)
+                return;
+        struct scan_job *jobs = xa_arena_alloc(a, njobs * sizeof *jobs);
+        for (int j = 0; j < njobs; ++j) {
+                jobs[j] = (struct scan_job){.index = j};
+                jobs[j].wins = xa_arena_alloc(a, (total / njobs + 1) *
+                                              sizeof(xcb_window_t));
+        }
+        int k = 0;
+        for (int r = 0; r < nroots; ++r) {
+                if (!qtr[r])
+                        continue;
+                xcb_window_t *children = xcb_query_tree_children(qtr[r]);
+                int nc = xcb_query_tree_children_length(qtr[r]);
+                for (int i = 0; i < nc; ++i, ++k) {
+                        struct scan_job *job = &jobs[k % njobs];
+                        job->wins[job->nwins++] = children[i];
+                }
+        }
+
+        for (int j = 0; j < njobs; ++j)
+                if (pthread_create(&jobs[j].thread, NULL, scan_worker,
+                                   &jobs[j]) != 0)
+                        panic("pthread_create failed");
+        for (int j = 0; j < njobs; ++j) {
+                struct scan_job *job = &jobs[j];
+                pthread_join(job->thread, NULL);
+                if (job->failed) {
+                        walk_windows(job->wins, job->nwins, &job->res);
+                        merge_targets(out, &job->res);
+                        continue;
+                }
+                merge_targets(out, &job->res);
+                for (int i = 0; i < job->nseen; ++i)
+                        note_seen(&job->seen[i]);
+                free(job->seen);
+                xa_stats.requests += job->stats.requests;
+                xa_stats.switches += job->stats.switches;
+                xa_stats.round_trips += job->stats.round_trips;
+                xa_stats.tasks += job->stats.tasks;
+                xa_stats.slabs += job->stats.slabs;
+                xa_stats.alloc_ns += job->stats.alloc_ns;
+        }
+}
+
+struct targets
+find_target(void)
+{
+        struct targets res = {};
+        nseen = 0;
+
+        // An explicit -s means the caller wants a real scan.
+        bool scanned = scan_engine == SCAN_AUTO && ask_daemon(&res);
+        if (scanned)
+                return res;
+
+        struct target_check tc;
+        target_cache_start(&tc, scan_engine == SCAN_AUTO);
+        if (target_cache_hit(&tc, &res)) {
+                target_cache_finish(&tc);
+                xa_arena_release(&scan_arena);
+                return res;
+        }
+        nseen = 0;
+
+        if (scan_engine == SCAN_AUTO || scan_engine == SCAN_CLIENTS) {
+                scanned = get_client_list_windows(roots, nroots, &res);
+                // A stale atom cache looks just like a missing
+                // _NET_CLIENT_LIST, so rule that out before giving up.
+                if (!scanned && scan_engine == SCAN_CLIENTS && atoms_stale()) {
+                        res = (struct targets){};
+                        nseen = 0;
+                        scanned = get_client_list_windows(roots, nroots,
+                                                          &res);
+                }
+                if (!scanned && scan_engine == SCAN_CLIENTS) {
+                        fprintf(stderr, "No usable _NET_CLIENT_LIST\n");
+                        exit(1);
+                }
+        }
+        if (!scanned && scan_jobs > 1)
+                walk_windows_parallel(&res);
+        else if (!scanned)
+                walk_windows(roots, nroots, &res);
+        target_cache_finish(&tc);
+        xa_arena_release(&scan_arena);
+        return res;
+}
+
+// Point screen at the screen containing win.
+void
+find_screen(xcb_window_t win)
+{
+        if (nroots == 1)
+                return;
+        xcb_query_tree_cookie_t qt = xcb_query_tree(conn, win);
+        XA_TRACE_REQ("QueryTree", qt);
+        xcb_query_tree_reply_t *qtr = xa_await(qt.sequence, NULL);
+        if (!qtr)
+                return;
+        xcb_screen_iterator_t it = xcb_setup_roots_iterator(setup);
+        for (; it.rem; xcb_screen_next(&it))
+                if (it.data->root == qtr->root)
+                        screen = it.data;
+        free(qtr);
+}
+
+// If FLING_STATS is set, print a summary line to stderr at exit for
+// benchmarks to collect.
+static void
+print_stats(uint64_t start, uint64_t scan_time)
+{
+        struct rusage ru;
+        getrusage(RUSAGE_SELF, &ru);
+        fprintf(stderr, "fling-stats wall_ms=%.3f scan_ms=%.3f "
+                "requests=%lu round_trips=%lu switches=%lu maxrss_kb=%ld\n",
+                (xa_trace_now() - start) / 1e6, scan_time / 1e6,
+                xa_stats.requests, xa_stats.round_trips,
+                xa_stats.switches, ru.ru_maxrss);
 }
 
 int
 main(int argc, char **argv)
 {
-        char *path = parse_args(argc, argv);
+        uint64_t main_start = xa_trace_now();
+        xa_trace_init(getenv("FLING_TRACE"));
+        char *uris = parse_args(argc, argv);
 
-        pth_init();
+        const char *stack_size = getenv("FLING_STACK_SIZE");
+        if (stack_size)
+                xa_task_stack_size = parse_stack_size(stack_size);
 
+        uint64_t start = xa_trace_now();
         conn = xcb_connect(NULL, NULL);
         if (xcb_connection_has_error(conn)) {
                 fprintf(stderr, "Error opening display\n");
                 exit(1);
         }
+        xa_init(conn);
         setup = xcb_get_setup(conn);
         screen = xcb_setup_roots_iterator(setup).data;
+        nroots = xcb_setup_roots_length(setup);
+        roots = malloc(nroots * sizeof *roots);
+        if (!roots)
+                panic("failed to malloc roots");
+        xcb_screen_iterator_t it = xcb_setup_roots_iterator(setup);
+        for (int i = 0; it.rem; xcb_screen_next(&it), ++i)
+                roots[i] = it.data->root;
+        xa_trace_span("connect", start);
 
-        get_top_level_windows(screen->root);
-        int rounds = 0;
-        while (xcb_task_main.next != &xcb_task_main) {
-                rounds++;
-                xcb_wait();
+        start = xa_trace_now();
+        intern_atoms(true);
+        xa_trace_span("intern_atoms", start);
+        if (daemon_mode) {
+                atoms_stale();
+                run_daemon();
         }
+
+        start = xa_trace_now();
+        struct targets t = find_target();
+        // If the atom cache was wrong, the scan looked at the wrong
+        // properties.  This is rare, so just do it again.
+        if (atoms_stale())
+                t = find_target();
+        xa_trace_span("find_target", start);
+        uint64_t scan_time = xa_trace_now() - start;
 #if DEBUG
-        printf("Window lookup took %d rounds\n", rounds);
+        printf("Window lookup took %lu requests, %lu round trips, "
+               "%lu switches\n", xa_stats.requests,
+               xa_stats.round_trips, xa_stats.switches);
+        printf("Allocated %lu tasks from %lu slabs in %.3f ms\n",
+               xa_stats.tasks, xa_stats.slabs, xa_stats.alloc_ns / 1e6);
 #endif
 
-        if (!found_some) {
-                fprintf(stderr, "No Emacs windows found\n");
+        if (!t.found_some) {
+                fprintf(stderr, "No windows match \"%s\"\n",
+                        match_plan.spec);
                 exit(1);
-        } else if (!found_visible) {
-                fprintf(stderr, "No Emacs windows are visible\n");
+        } else if (!t.found_visible) {
+                fprintf(stderr, "No windows matching \"%s\" are visible\n",
+                        match_plan.spec);
                 exit(1);
         }
 
 #if DEBUG
-        printf("Best %#x\n", best_window);
+        printf("Best %#x\n", t.best_window);
 #endif
 
-        do_dnd(best_window, path);
+        start = xa_trace_now();
+        find_screen(t.best_window);
+        do_dnd(t.best_window, uris);
+        xa_trace_span("do_dnd", start);
 
         xcb_disconnect(conn);
-        free(path);
+        free(uris);
+        if (getenv("FLING_STATS"))
+                print_stats(main_start, scan_time);
         return 0;
 }
 
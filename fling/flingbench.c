@@ -0,0 +1,512 @@
+// Helpers for bench.sh.
+//
+// flingbench tree populates an X server with a synthetic window tree
+// and then acts as the XDND target for fling, answering XdndPosition
+// with XdndStatus and XdndDrop with XdndFinished once it has fetched
+// the dropped uri-list.
+//
+// flingbench proxy forwards X connections from one display to
+// another, delaying everything it forwards to imitate a slow link
+// such as ssh X forwarding.
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <xcb/xcb.h>
+
+void
+panic(const char *str)
+{
+        fprintf(stderr, "%s\n", str);
+        abort();
+}
+
+//////////////////////////////////////////////////////////////////
+// Tree
+//
+
+static xcb_connection_t *conn;
+static xcb_screen_t *screen;
+
+static xcb_atom_t
+intern(const char *name)
+{
+        xcb_intern_atom_reply_t *r = xcb_intern_atom_reply(
+                conn, xcb_intern_atom(conn, false, strlen(name), name), NULL);
+        if (!r)
+                panic("InternAtom failed");
+        xcb_atom_t atom = r->atom;
+        free(r);
+        return atom;
+}
+
+static xcb_atom_t WM_STATE, _NET_WM_USER_TIME, _NET_CLIENT_LIST,
+        _NET_SUPPORTING_WM_CHECK, XdndAware, XdndSelection, XdndEnter,
+        XdndPosition, XdndStatus, XdndDrop, XdndFinished, XdndActionCopy,
+        textUriList, INCR, FLINGBENCH;
+
+struct tree_opts
+{
+        int depth, fanout, clients, emacs;
+        bool client_list;
+};
+
+// Clients, in creation order.
+static xcb_window_t *clients;
+static int nclients;
+
+static void
+set_property(xcb_window_t win, xcb_atom_t prop, xcb_atom_t type, int format,
+             int len, const void *data)
+{
+        xcb_change_property(conn, XCB_PROP_MODE_REPLACE, win, prop, type,
+                            format, len, data);
+}
+
+static void
+make_client(xcb_window_t win, bool emacs)
+{
+        uint32_t state[] = {1, 0};
+        set_property(win, WM_STATE, WM_STATE, 32, 2, state);
+        if (emacs) {
+                static const char cls[] = "emacs\0Emacs";
+                uint32_t version = 5, user_time = nclients + 1;
+                set_property(win, XCB_ATOM_WM_CLASS, XCB_ATOM_STRING, 8,
+                             sizeof cls, cls);
+                set_property(win, _NET_WM_USER_TIME, XCB_ATOM_CARDINAL, 32,
+                             1, &user_time);
+                set_property(win, XdndAware, XCB_ATOM_ATOM, 32, 1, &version);
+        } else {
+                static const char cls[] = "xterm\0XTerm";
+                set_property(win, XCB_ATOM_WM_CLASS, XCB_ATOM_STRING, 8,
+                             sizeof cls, cls);
+        }
+        clients[nclients++] = win;
+}
+
+// Return whether item i of n is one of the k picked evenly.
+static bool
+spread(long i, long k, long n)
+{
+        return i * k / n != (i + 1) * k / n;
+}
+
+// Create the subtree under parent.  leaf counts the leaves created
+// so far, which decides which of them become clients.
+static void
+make_tree(const struct tree_opts *o, xcb_window_t parent, int depth,
+          long nleaves, long *leaf)
+{
+        for (int i = 0; i < o->fanout; ++i) {
+                xcb_window_t win = xcb_generate_id(conn);
+                uint32_t mask = XCB_CW_EVENT_MASK;
+                uint32_t values[] = {XCB_EVENT_MASK_PROPERTY_CHANGE};
+                xcb_create_window(conn, XCB_COPY_FROM_PARENT, win, parent,
+                                  0, 0, 1, 1, 0,
+                                  XCB_WINDOW_CLASS_INPUT_OUTPUT,
+                                  screen->root_visual, mask, values);
+                if (depth + 1 < o->depth) {
+                        make_tree(o, win, depth + 1, nleaves, leaf);
+                } else {
+                        // Spread the clients evenly over the leaves
+                        // and the Emacs clients evenly over those.
+                        long k = (*leaf)++;
+                        if (spread(k, o->clients, nleaves)) {
+                                long c = nclients;
+                                make_client(win, spread(c, o->emacs,
+                                                        o->clients));
+                        }
+                }
+                xcb_map_window(conn, win);
+        }
+}
+
+// Publish EWMH client list properties on the root, as a window
+// manager would.
+static void
+publish_client_list(void)
+{
+        xcb_window_t check = xcb_generate_id(conn);
+        xcb_create_window(conn, XCB_COPY_FROM_PARENT, check, screen->root,
+                          0, 0, 1, 1, 0, XCB_WINDOW_CLASS_INPUT_ONLY,
+                          screen->root_visual, 0, NULL);
+        set_property(check, _NET_SUPPORTING_WM_CHECK, XCB_ATOM_WINDOW, 32,
+                     1, &check);
+        set_property(screen->root, _NET_SUPPORTING_WM_CHECK, XCB_ATOM_WINDOW,
+                     32, 1, &check);
+        set_property(screen->root, _NET_CLIENT_LIST, XCB_ATOM_WINDOW, 32,
+                     nclients, clients);
+}
+
+static void
+send_client_message(xcb_window_t to, xcb_atom_t type, uint32_t d0,
+                    uint32_t d1, uint32_t d2, uint32_t d3, uint32_t d4)
+{
+        xcb_client_message_event_t msg;
+        memset(&msg, 0, sizeof msg);
+        msg.response_type = XCB_CLIENT_MESSAGE;
+        msg.window = to;
+        msg.type = type;
+        msg.format = 32;
+        msg.data.data32[0] = d0;
+        msg.data.data32[1] = d1;
+        msg.data.data32[2] = d2;
+        msg.data.data32[3] = d3;
+        msg.data.data32[4] = d4;
+        xcb_send_event(conn, false, to, 0, (char*)&msg);
+}
+
+// Fetch and delete FLINGBENCH on win.  Returns its length, or -1 if
+// it's an INCR announcement.
+static int
+take_property(xcb_window_t win)
+{
+        xcb_get_property_reply_t *r = xcb_get_property_reply(
+                conn, xcb_get_property(conn, true, win, FLINGBENCH,
+                                       XCB_GET_PROPERTY_TYPE_ANY, 0,
+                                       UINT32_MAX / 4), NULL);
+        if (!r)
+                return 0;
+        int len = r->type == INCR ? -1 : xcb_get_property_value_length(r);
+        free(r);
+        return len;
+}
+
+// Act as the XDND target for every Emacs client.
+static void
+serve_dnd(void)
+{
+        xcb_window_t source = 0, target = 0;
+        bool incr = false;
+        long bytes = 0;
+        xcb_generic_event_t *ev;
+        while ((ev = xcb_wait_for_event(conn))) {
+                xcb_client_message_event_t *cev =
+                        (xcb_client_message_event_t*)ev;
+                int typ = ev->response_type & ~0x80;
+                bool done = false;
+                if (typ == XCB_CLIENT_MESSAGE && cev->type == XdndEnter) {
+                        source = cev->data.data32[0];
+                        target = cev->window;
+                } else if (typ == XCB_CLIENT_MESSAGE &&
+                           cev->type == XdndPosition) {
+                        send_client_message(source, XdndStatus, target, 1,
+                                            0, 0, XdndActionCopy);
+                } else if (typ == XCB_CLIENT_MESSAGE &&
+                           cev->type == XdndDrop) {
+                        bytes = 0;
+                        xcb_convert_selection(conn, target, XdndSelection,
+                                              textUriList, FLINGBENCH,
+                                              cev->data.data32[2]);
+                } else if (typ == XCB_SELECTION_NOTIFY) {
+                        int len = take_property(target);
+                        if (len < 0)
+                                incr = true;
+                        else
+                                bytes = len, done = true;
+                } else if (typ == XCB_PROPERTY_NOTIFY && incr) {
+                        xcb_property_notify_event_t *pev =
+                                (xcb_property_notify_event_t*)ev;
+                        if (pev->window == target && pev->atom == FLINGBENCH &&
+                            pev->state == XCB_PROPERTY_NEW_VALUE) {
+                                int len = take_property(target);
+                                bytes += len;
+                                if (len == 0)
+                                        incr = false, done = true;
+                        }
+                }
+                if (done) {
+                        send_client_message(source, XdndFinished, target, 1,
+                                            XdndActionCopy, 0, 0);
+                        printf("dropped %ld bytes\n", bytes);
+                        fflush(stdout);
+                }
+                xcb_flush(conn);
+                free(ev);
+        }
+        fprintf(stderr, "flingbench: X connection closed\n");
+}
+
+static int
+tree_main(int argc, char **argv)
+{
+        struct tree_opts o = {.depth = 3, .fanout = 10, .clients = 50,
+                              .emacs = 2};
+        int opt;
+        while ((opt = getopt(argc, argv, "d:f:c:e:l")) != -1) {
+                switch (opt) {
+                case 'd': o.depth = atoi(optarg); break;
+                case 'f': o.fanout = atoi(optarg); break;
+                case 'c': o.clients = atoi(optarg); break;
+                case 'e': o.emacs = atoi(optarg); break;
+                case 'l': o.client_list = true; break;
+                default: return 2;
+                }
+        }
+        long nleaves = 1;
+        for (int i = 0; i < o.depth; ++i)
+                nleaves *= o.fanout;
+        if (o.depth < 1 || o.fanout < 1 || o.clients > nleaves ||
+            o.emacs > o.clients || o.emacs < 1) {
+                fprintf(stderr, "flingbench: need 1 <= emacs <= clients <= "
+                        "fanout^depth (%ld)\n", nleaves);
+                return 2;
+        }
+
+        conn = xcb_connect(NULL, NULL);
+        if (xcb_connection_has_error(conn)) {
+                fprintf(stderr, "flingbench: error opening display\n");
+                return 1;
+        }
+        screen = xcb_setup_roots_iterator(xcb_get_setup(conn)).data;
+#define A(name) name = intern(#name)
+        A(WM_STATE); A(_NET_WM_USER_TIME); A(_NET_CLIENT_LIST);
+        A(_NET_SUPPORTING_WM_CHECK); A(XdndAware); A(XdndSelection);
+        A(XdndEnter); A(XdndPosition); A(XdndStatus); A(XdndDrop);
+        A(XdndFinished); A(XdndActionCopy); A(INCR); A(FLINGBENCH);
+#undef A
+        textUriList = intern("text/uri-list");
+
+        clients = malloc(o.clients * sizeof *clients);
+        if (!clients)
+                panic("failed to malloc clients");
+        long leaf = 0;
+        make_tree(&o, screen->root, 0, nleaves, &leaf);
+        if (o.client_list)
+                publish_client_list();
+        free(xcb_get_input_focus_reply(conn, xcb_get_input_focus(conn),
+                                       NULL));
+        printf("ready %ld windows %d clients\n", nleaves, nclients);
+        fflush(stdout);
+
+        serve_dnd();
+        return 1;
+}
+
+//////////////////////////////////////////////////////////////////
+// Latency proxy
+//
+
+struct chunk
+{
+        struct chunk *next;
+        uint64_t due;
+        size_t len, off;
+        char data[];
+};
+
+// One direction of a proxied connection.
+struct proxy_pipe
+{
+        int from, to;
+        struct chunk *head, *tail;
+};
+
+struct proxy_conn
+{
+        struct proxy_pipe up, down;
+        bool closed;
+};
+
+static uint64_t
+now_ns(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int
+display_socket(int display, bool listening)
+{
+        struct sockaddr_un addr = {.sun_family = AF_UNIX};
+        snprintf(addr.sun_path, sizeof addr.sun_path, "/tmp/.X11-unix/X%d",
+                 display);
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+                return -1;
+        if (listening) {
+                unlink(addr.sun_path);
+                if (bind(fd, (struct sockaddr*)&addr, sizeof addr) < 0 ||
+                    listen(fd, 16) < 0)
+                        goto fail;
+        } else if (connect(fd, (struct sockaddr*)&addr, sizeof addr) < 0) {
+                goto fail;
+        }
+        return fd;
+fail:
+        close(fd);
+        return -1;
+}
+
+// Read whatever is available on p->from and queue it to go out after
+// delay.  Returns false on EOF.
+static bool
+pipe_read(struct proxy_pipe *p, uint64_t delay)
+{
+        struct chunk *c = malloc(sizeof *c + 65536);
+        if (!c)
+                panic("failed to malloc chunk");
+        ssize_t n = read(p->from, c->data, 65536);
+        if (n <= 0) {
+                free(c);
+                return n < 0 && errno == EINTR;
+        }
+        c->next = NULL;
+        c->due = now_ns() + delay;
+        c->len = n;
+        c->off = 0;
+        if (p->tail)
+                p->tail->next = c;
+        else
+                p->head = c;
+        p->tail = c;
+        return true;
+}
+
+// Write out every chunk that's due.  Returns false on error.
+static bool
+pipe_write(struct proxy_pipe *p, uint64_t now)
+{
+        while (p->head && p->head->due <= now) {
+                struct chunk *c = p->head;
+                ssize_t n = write(p->to, c->data + c->off, c->len - c->off);
+                if (n < 0)
+                        return errno == EINTR || errno == EAGAIN;
+                c->off += n;
+                if (c->off < c->len)
+                        return true;
+                p->head = c->next;
+                if (!p->head)
+                        p->tail = NULL;
+                free(c);
+        }
+        return true;
+}
+
+static int
+proxy_main(int argc, char **argv)
+{
+        double latency_ms = 0;
+        int opt;
+        while ((opt = getopt(argc, argv, "l:")) != -1) {
+                switch (opt) {
+                case 'l': latency_ms = atof(optarg); break;
+                default: return 2;
+                }
+        }
+        if (argc - optind != 2) {
+                fprintf(stderr, "usage: flingbench proxy [-l ms] "
+                        "listen-display server-display\n");
+                return 2;
+        }
+        int listen_display = atoi(argv[optind]);
+        int server_display = atoi(argv[optind + 1]);
+        // Delay each direction by half, so a round trip costs
+        // latency_ms.
+        uint64_t delay = latency_ms * 1e6 / 2;
+
+        int lfd = display_socket(listen_display, true);
+        if (lfd < 0) {
+                perror("flingbench: listening");
+                return 1;
+        }
+        printf("ready\n");
+        fflush(stdout);
+
+        struct proxy_conn **conns = NULL;
+        int nconns = 0;
+        struct pollfd *pfds = NULL;
+        while (1) {
+                // Reap closed connections once their queues are empty.
+                for (int i = 0; i < nconns; ++i) {
+                        struct proxy_conn *pc = conns[i];
+                        if (pc->closed && !pc->up.head && !pc->down.head) {
+                                close(pc->up.from);
+                                close(pc->up.to);
+                                free(pc);
+                                conns[i--] = conns[--nconns];
+                        }
+                }
+
+                pfds = realloc(pfds, (2 * nconns + 1) * sizeof *pfds);
+                if (!pfds)
+                        panic("failed to realloc pollfds");
+                pfds[0] = (struct pollfd){.fd = lfd, .events = POLLIN};
+                uint64_t now = now_ns(), next = UINT64_MAX;
+                for (int i = 0; i < nconns; ++i) {
+                        struct proxy_conn *pc = conns[i];
+                        short ev = pc->closed ? 0 : POLLIN;
+                        pfds[1 + 2*i] = (struct pollfd){
+                                .fd = pc->up.from, .events = ev};
+                        pfds[2 + 2*i] = (struct pollfd){
+                                .fd = pc->down.from, .events = ev};
+                        if (pc->up.head && pc->up.head->due < next)
+                                next = pc->up.head->due;
+                        if (pc->down.head && pc->down.head->due < next)
+                                next = pc->down.head->due;
+                }
+                int timeout = -1;
+                if (next != UINT64_MAX)
+                        timeout = next <= now ? 0 : (next - now + 999999) / 1000000;
+                if (poll(pfds, 2 * nconns + 1, timeout) < 0 && errno != EINTR)
+                        panic("poll failed");
+
+                now = now_ns();
+                for (int i = 0; i < nconns; ++i) {
+                        struct proxy_conn *pc = conns[i];
+                        if ((pfds[1 + 2*i].revents & (POLLIN|POLLHUP) &&
+                             !pipe_read(&pc->up, delay)) ||
+                            (pfds[2 + 2*i].revents & (POLLIN|POLLHUP) &&
+                             !pipe_read(&pc->down, delay)))
+                                pc->closed = true;
+                        if (!pipe_write(&pc->up, now) ||
+                            !pipe_write(&pc->down, now))
+                                pc->closed = true;
+                }
+
+                if (pfds[0].revents & POLLIN) {
+                        int cfd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+                        if (cfd < 0)
+                                continue;
+                        int sfd = display_socket(server_display, false);
+                        if (sfd < 0) {
+                                close(cfd);
+                                continue;
+                        }
+                        struct proxy_conn *pc = calloc(1, sizeof *pc);
+                        if (!pc)
+                                panic("failed to calloc connection");
+                        pc->up.from = pc->down.to = cfd;
+                        pc->up.to = pc->down.from = sfd;
+                        conns = realloc(conns, (nconns + 1) * sizeof *conns);
+                        if (!conns)
+                                panic("failed to realloc connections");
+                        conns[nconns++] = pc;
+                }
+        }
+}
+
+int
+main(int argc, char **argv)
+{
+        if (argc >= 2 && strcmp(argv[1], "tree") == 0)
+                return tree_main(argc - 1, argv + 1);
+        if (argc >= 2 && strcmp(argv[1], "proxy") == 0)
+                return proxy_main(argc - 1, argv + 1);
+        fprintf(stderr, "usage: %s tree [-d depth] [-f fanout] [-c clients] "
+                "[-e emacs] [-l]\n"
+                "       %s proxy [-l ms] listen-display server-display\n",
+                argv[0], argv[0]);
+        return 2;
+}
@@ -0,0 +1,76 @@
+#!/bin/sh
+#
+# Stress the task scheduler against a headless Xvfb.  See usage below,
+# or run "make test".
+
+usage() {
+    echo "usage: $0 [-d depth] [-f fanout] [-c clients] [-t threads] [-n walks]
+
+Start Xvfb, create a tree of fanout^depth leaf windows of which
+<clients> are WM_STATE clients, and have <threads> threads each walk
+the whole tree <walks> times with one task per window." >&2
+    exit 2
+}
+
+set -e
+
+DEPTH=4
+FANOUT=8
+CLIENTS=1000
+THREADS=4
+WALKS=3
+while getopts "d:f:c:t:n:" opt; do
+    case $opt in
+        d) DEPTH=$OPTARG ;;
+        f) FANOUT=$OPTARG ;;
+        c) CLIENTS=$OPTARG ;;
+        t) THREADS=$OPTARG ;;
+        n) WALKS=$OPTARG ;;
+        *) usage ;;
+    esac
+done
+
+if ! command -v Xvfb >/dev/null; then
+    echo "Xvfb not found; skipping stress test" >&2
+    exit 0
+fi
+
+HERE=$(cd $(dirname $0) && pwd)
+TMP=$(mktemp -d)
+PIDS=
+cleanup() {
+    for pid in $PIDS; do
+        kill $pid 2>/dev/null || true
+    done
+    rm -rf $TMP
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+# Wait for $1 to exist and be non-empty.
+wait_for() {
+    for i in $(seq 100); do
+        if [ -s "$1" ]; then
+            return 0
+        fi
+        sleep 0.1
+    done
+    echo "Timed out waiting for $1" >&2
+    exit 1
+}
+
+free_display() {
+    n=${1:-90}
+    while [ -e /tmp/.X11-unix/X$n -o -e /tmp/.X$n-lock ]; do
+        n=$(expr $n + 1)
+    done
+    echo $n
+}
+
+XDISPLAY=$(free_display)
+Xvfb :$XDISPLAY -nolisten tcp -screen 0 1280x1024x24 >$TMP/xvfb.log 2>&1 &
+PIDS="$PIDS $!"
+wait_for /tmp/.X11-unix/X$XDISPLAY
+
+DISPLAY=:$XDISPLAY $HERE/xcbasync_stress -d $DEPTH -f $FANOUT -c $CLIENTS \
+    -t $THREADS -n $WALKS
@@ -0,0 +1,859 @@
+// libxcbasync: cooperative tasks for pipelining X requests.  See
+// xcbasync.h for the interface.
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include <xcb/xcb.h>
+#include <xcb/xcbext.h>
+
+#include "xcbasync.h"
+
+static void
+panic(const char *str)
+{
+        fprintf(stderr, "%s\n", str);
+        abort();
+}
+
+//////////////////////////////////////////////////////////////////
+// Tracing
+//
+// Once xa_trace_init is given a file, record a span for every X request
+// from when it's issued to when its reply is consumed, tagged with
+// the issuing task, plus every scheduler switch and every stall
+// waiting on the server.  At exit these are written out in the Chrome
+// trace-event format, which chrome://tracing and Perfetto can load.
+// Each X connection appears as its own process.
+
+struct trace_event
+{
+        const char *name;
+        uint64_t start, end;
+        unsigned int seq;
+        int pid, tid;
+        // 'X' for a span, 'i' for an instant
+        char ph;
+};
+
+// Don't let a long-running process grow without bound.
+#define TRACE_MAX_EVENTS (1 << 20)
+
+static const char *trace_path;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_event *trace_events;
+static int trace_nevents, trace_cap;
+static __thread int trace_pid;
+
+// Map from sequence number (relative to trace_seq_base) to the index
+// of the request's span in trace_events, or -1.
+static __thread int *trace_seq_index;
+static __thread unsigned int trace_seq_base, trace_seq_cap;
+
+static int trace_tid(void);
+
+uint64_t
+xa_trace_now(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Add an event and return its index, or -1 if the trace is full.
+static int
+trace_add(const char *name, char ph, uint64_t start, uint64_t end, unsigned int seq)
+{
+        int i = -1;
+        pthread_mutex_lock(&trace_lock);
+        if (trace_nevents == trace_cap && trace_cap < TRACE_MAX_EVENTS) {
+                trace_cap = trace_cap ? 2 * trace_cap : 1024;
+                trace_events = realloc(trace_events,
+                                       trace_cap * sizeof *trace_events);
+                if (!trace_events)
+                        panic("failed to realloc trace");
+        }
+        if (trace_nevents < trace_cap) {
+                i = trace_nevents++;
+                struct trace_event *ev = &trace_events[i];
+                ev->name = name;
+                ev->ph = ph;
+                ev->start = start;
+                ev->end = end;
+                ev->seq = seq;
+                ev->pid = trace_pid;
+                ev->tid = trace_tid();
+        }
+        pthread_mutex_unlock(&trace_lock);
+        return i;
+}
+
+// Record that request seq was just issued.
+void
+xa_trace_issue(const char *name, unsigned int seq)
+{
+        if (!trace_path)
+                return;
+        uint64_t now = xa_trace_now();
+        int i = trace_add(name, 'X', now, now, seq);
+        if (i < 0)
+                return;
+
+        if (!trace_seq_cap)
+                trace_seq_base = seq;
+        if (seq - trace_seq_base >= trace_seq_cap) {
+                unsigned int old = trace_seq_cap;
+                while (seq - trace_seq_base >= trace_seq_cap)
+                        trace_seq_cap = trace_seq_cap ? 2 * trace_seq_cap : 1024;
+                trace_seq_index = realloc(trace_seq_index,
+                                          trace_seq_cap * sizeof(int));
+                if (!trace_seq_index)
+                        panic("failed to realloc trace index");
+                memset(trace_seq_index + old, -1,
+                       (trace_seq_cap - old) * sizeof(int));
+        }
+        trace_seq_index[seq - trace_seq_base] = i;
+}
+
+// Record that the reply to request seq was consumed.
+void
+xa_trace_complete(unsigned int seq)
+{
+        if (!trace_seq_index || seq - trace_seq_base >= trace_seq_cap)
+                return;
+        int i = trace_seq_index[seq - trace_seq_base];
+        if (i < 0)
+                return;
+        uint64_t now = xa_trace_now();
+        pthread_mutex_lock(&trace_lock);
+        trace_events[i].end = now;
+        pthread_mutex_unlock(&trace_lock);
+}
+
+void
+xa_trace_span(const char *name, uint64_t start)
+{
+        if (!trace_path)
+                return;
+        trace_add(name, 'X', start, xa_trace_now(), 0);
+}
+
+void
+xa_trace_instant(const char *name)
+{
+        if (trace_path) {
+                uint64_t now = xa_trace_now();
+                trace_add(name, 'i', now, now, 0);
+        }
+}
+
+static void
+trace_write(void)
+{
+        FILE *f = fopen(trace_path, "w");
+        if (!f) {
+                perror(trace_path);
+                return;
+        }
+        uint64_t base = UINT64_MAX;
+        for (int i = 0; i < trace_nevents; ++i)
+                if (trace_events[i].start < base)
+                        base = trace_events[i].start;
+        fprintf(f, "{\"traceEvents\":[\n");
+        for (int i = 0; i < trace_nevents; ++i) {
+                struct trace_event *ev = &trace_events[i];
+                fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":%d,"
+                        "\"tid\":%d,\"ts\":%.3f",
+                        i ? ",\n" : "", ev->name, ev->ph, ev->pid + 1,
+                        ev->tid, (ev->start - base) / 1e3);
+                if (ev->ph == 'X')
+                        fprintf(f, ",\"dur\":%.3f", (ev->end - ev->start) / 1e3);
+                else
+                        fprintf(f, ",\"s\":\"t\"");
+                if (ev->seq)
+                        fprintf(f, ",\"args\":{\"seq\":%u}", ev->seq);
+                fprintf(f, "}");
+        }
+        fprintf(f, "\n]}\n");
+        fclose(f);
+}
+
+void
+xa_trace_init(const char *path)
+{
+        if (!path || !*path)
+                return;
+        trace_path = path;
+        atexit(trace_write);
+}
+
+void
+xa_trace_set_pid(int pid)
+{
+        trace_pid = pid;
+}
+
+//////////////////////////////////////////////////////////////////
+// XCB tasks
+//
+// A tiny cooperative task system for hiding X round-trip latency.
+// Each task runs on its own stack.  A task that needs a reply
+// registers the request's sequence number with xa_await and sleeps
+// until the reply has arrived; since the server answers requests in
+// order, only the oldest waiter ever needs to be polled.  When no
+// task is runnable, the scheduler flushes the connection and blocks
+// on its socket.
+//
+// Stacks are carved out of large mmap'd slabs and recycled through a
+// free pool, so spawning a task is usually just a few pointer
+// operations rather than an allocation.
+
+// Default size of each task's stack.
+#ifndef XA_TASK_STACK_SIZE
+#define XA_TASK_STACK_SIZE (16*1024)
+#endif
+
+// Number of task slots in the first slab.  Each later slab is twice
+// as large as the last.
+#define XA_TASK_SLAB_MIN 64
+
+#define XA_TASK_CANARY 0x466c696e67537461ull
+
+#if !defined(__x86_64__)
+#define XA_TASK_UCONTEXT 1
+#include <ucontext.h>
+#endif
+
+struct xa_task
+{
+#if XA_TASK_UCONTEXT
+        ucontext_t ctx;
+#else
+        void *sp;
+#endif
+        // Links in the run queue or the wait queue.  The current
+        // task is on neither.
+        struct xa_task *next, *prev;
+
+        void (*start)(void*);
+        void *arg;
+        bool dead;
+        // The group this task belongs to, or NULL.
+        struct xa_group *group;
+        // For tracing.  The main task is 0.
+        int id;
+
+        // Sequence number this task is waiting on in the wait queue,
+        // and the result of the wait.
+        unsigned int wait_seq;
+        void *reply;
+        xcb_generic_error_t *error;
+
+        // The stack lives directly above the task structure.  The
+        // canary sits at the very bottom of the stack, where an
+        // overflow will clobber it first.
+        uint64_t *canary;
+        char *stack_top;
+};
+
+size_t xa_task_stack_size = XA_TASK_STACK_SIZE;
+
+// xa_task_stack_size as of the first xa_init.  Every thread pools
+// stacks of this size.
+static size_t task_stack_size;
+static pthread_once_t task_stack_once = PTHREAD_ONCE_INIT;
+
+// All of the scheduler's state is per-thread, so each thread can
+// drive its own connection with its own tasks.
+static __thread xcb_connection_t *conn;
+
+static __thread struct xa_task xa_task_main;
+static __thread struct xa_task *xa_task_cur;
+static __thread int xa_task_ids;
+
+static int
+trace_tid(void)
+{
+        return xa_task_cur ? xa_task_cur->id : 0;
+}
+
+// Queue heads.  The run queue is in FIFO order.  The wait queue is
+// sorted by wait_seq.
+static __thread struct xa_task xa_runq, xa_waitq;
+
+// The number of spawned tasks that haven't exited, the task blocked
+// in xa_drain, if any, and a task that has exited but whose stack
+// hasn't been returned to the pool yet.
+static __thread int xa_ntasks;
+static __thread struct xa_task *xa_task_drainer, *xa_task_dead;
+
+__thread struct xa_stats xa_stats;
+
+// Free task pool, linked through next.
+static __thread struct xa_task *xa_task_pool;
+static __thread size_t xa_task_slab_slots = XA_TASK_SLAB_MIN;
+
+static void xa_task_free(struct xa_task *task);
+static void xa_schedule(void);
+
+static void
+xa_task_unlink(struct xa_task *task)
+{
+        task->next->prev = task->prev;
+        task->prev->next = task->next;
+}
+
+// Insert task after pos.
+static void
+xa_task_insert(struct xa_task *pos, struct xa_task *task)
+{
+        task->prev = pos;
+        task->next = pos->next;
+        pos->next->prev = task;
+        pos->next = task;
+}
+
+static void
+xa_task_enqueue(struct xa_task *q, struct xa_task *task)
+{
+        xa_task_insert(q->prev, task);
+}
+
+static bool
+xa_seq_before(unsigned int a, unsigned int b)
+{
+        return (int)(a - b) < 0;
+}
+
+static void
+xa_task_reap(void)
+{
+        if (xa_task_dead) {
+                xa_task_free(xa_task_dead);
+                xa_task_dead = NULL;
+        }
+}
+
+static void
+xa_spawn_trampoline(void)
+{
+        xa_task_reap();
+        xa_task_cur->start(xa_task_cur->arg);
+        xa_task_cur->dead = true;
+
+        // Wake up our joiner if this was the last task in the group
+        // and xa_drain if this was the last task.  Our stack can't
+        // be freed until we've switched off of it, so leave that to
+        // whoever runs next.
+        struct xa_group *g = xa_task_cur->group;
+        if (g && --g->pending == 0 && g->joiner) {
+                xa_task_enqueue(&xa_runq, g->joiner);
+                g->joiner = NULL;
+        }
+        if (--xa_ntasks == 0 && xa_task_drainer) {
+                xa_task_enqueue(&xa_runq, xa_task_drainer);
+                xa_task_drainer = NULL;
+        }
+        xa_task_dead = xa_task_cur;
+        xa_schedule();
+        panic("Dead thread executed");
+}
+
+#if XA_TASK_UCONTEXT
+static void
+xa_task_init_ctx(struct xa_task *task, char *top)
+{
+        if (getcontext(&task->ctx) < 0)
+                panic("getcontext failed");
+        task->ctx.uc_stack.ss_sp = task->canary;
+        task->ctx.uc_stack.ss_size = top - (char*)task->canary;
+        task->ctx.uc_link = NULL;
+        makecontext(&task->ctx, xa_spawn_trampoline, 0);
+}
+
+static void
+xa_task_switch(struct xa_task *from, struct xa_task *to)
+{
+        swapcontext(&from->ctx, &to->ctx);
+}
+#else
+// Save the callee-saved registers on the current stack, store the
+// stack pointer in *from_sp, and resume the stack at to_sp.  Unlike
+// swapcontext, this doesn't touch the signal mask, so a switch
+// doesn't cost a system call.
+void xa_task_switch_sp(void **from_sp, void *to_sp);
+__asm__(".pushsection .text\n"
+        ".type xa_task_switch_sp, @function\n"
+        "xa_task_switch_sp:\n"
+        "\tpushq %rbp\n"
+        "\tpushq %rbx\n"
+        "\tpushq %r12\n"
+        "\tpushq %r13\n"
+        "\tpushq %r14\n"
+        "\tpushq %r15\n"
+        "\tmovq %rsp, (%rdi)\n"
+        "\tmovq %rsi, %rsp\n"
+        "\tpopq %r15\n"
+        "\tpopq %r14\n"
+        "\tpopq %r13\n"
+        "\tpopq %r12\n"
+        "\tpopq %rbx\n"
+        "\tpopq %rbp\n"
+        "\tret\n"
+        ".size xa_task_switch_sp, .-xa_task_switch_sp\n"
+        ".popsection\n");
+
+static void
+xa_task_init_ctx(struct xa_task *task, char *top)
+{
+        // Build a frame that xa_task_switch_sp will "return" into
+        // the trampoline from.  The zero word is the trampoline's
+        // (nonexistent) return address, which also gets the stack
+        // alignment right on entry.
+        void **sp = (void**)top;
+        *--sp = NULL;
+        *--sp = (void*)xa_spawn_trampoline;
+        for (int i = 0; i < 6; ++i)
+                *--sp = NULL;
+        task->sp = sp;
+}
+
+static void
+xa_task_switch(struct xa_task *from, struct xa_task *to)
+{
+        xa_task_switch_sp(&from->sp, to->sp);
+}
+#endif
+
+static void
+xa_task_grow_pool(void)
+{
+        // Each slot holds the task structure followed by its stack.
+        size_t hdr = (sizeof(struct xa_task) + 15) & ~(size_t)15;
+        if (!task_stack_size)
+                panic("xa_spawn called before xa_init");
+        size_t stack = (task_stack_size + 15) & ~(size_t)15;
+        size_t slot = hdr + stack;
+        size_t n = xa_task_slab_slots;
+        char *slab = mmap(NULL, n * slot, PROT_READ|PROT_WRITE,
+                          MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+        if (slab == MAP_FAILED)
+                panic("failed to mmap task stacks");
+        for (size_t i = n; i-- > 0; ) {
+                struct xa_task *task = (struct xa_task*)(slab + i * slot);
+                task->canary = (uint64_t*)((char*)task + hdr);
+                task->stack_top = (char*)task + slot;
+                task->next = xa_task_pool;
+                xa_task_pool = task;
+        }
+        xa_task_slab_slots *= 2;
+        xa_stats.slabs++;
+}
+
+static struct xa_task *
+xa_task_alloc(void)
+{
+        uint64_t start = xa_trace_now();
+        if (!xa_task_pool)
+                xa_task_grow_pool();
+        struct xa_task *task = xa_task_pool;
+        xa_task_pool = task->next;
+        task->dead = false;
+        *task->canary = XA_TASK_CANARY;
+        xa_stats.tasks++;
+        xa_stats.alloc_ns += xa_trace_now() - start;
+        return task;
+}
+
+static void
+xa_task_free(struct xa_task *task)
+{
+        if (*task->canary != XA_TASK_CANARY)
+                panic("Task stack overflow; increase xa_task_stack_size");
+        task->next = xa_task_pool;
+        xa_task_pool = task;
+}
+
+static void
+xa_task_setup(void)
+{
+        // The main task runs on the process stack, so its context is
+        // only ever filled in by switching away from it.
+        if (!xa_task_cur) {
+                xa_runq.next = xa_runq.prev = &xa_runq;
+                xa_waitq.next = xa_waitq.prev = &xa_waitq;
+                xa_task_cur = &xa_task_main;
+        }
+}
+
+// Move tasks whose replies have arrived from the wait queue to the
+// run queue.  If block is true and nothing could be woken, flush the
+// connection and wait for the server, repeating until something is
+// runnable.
+static void
+xa_poll_waiters(bool block)
+{
+        while (1) {
+                bool woke = false;
+                // Replies arrive in request order, so stop at the
+                // first waiter whose reply isn't in yet.
+                while (xa_waitq.next != &xa_waitq) {
+                        struct xa_task *t = xa_waitq.next;
+                        if (!xcb_poll_for_reply(conn, t->wait_seq,
+                                                &t->reply, &t->error))
+                                break;
+                        xa_task_unlink(t);
+                        xa_task_enqueue(&xa_runq, t);
+                        woke = true;
+                }
+                if (woke || !block)
+                        return;
+
+                if (xa_waitq.next == &xa_waitq)
+                        panic("Deadlock: no runnable or waiting tasks");
+                xcb_flush(conn);
+                if (xcb_connection_has_error(conn)) {
+                        fprintf(stderr, "X connection failed\n");
+                        exit(1);
+                }
+                struct pollfd pfd = {
+                        .fd = xcb_get_file_descriptor(conn),
+                        .events = POLLIN,
+                };
+                xa_stats.round_trips++;
+                uint64_t start = trace_path ? xa_trace_now() : 0;
+                if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+                        panic("poll failed");
+                xa_trace_span("stall", start);
+        }
+}
+
+// Switch to the next runnable task.  The caller must have already
+// put the current task wherever it belongs.
+static void
+xa_schedule(void)
+{
+        if (xa_runq.next == &xa_runq)
+                xa_poll_waiters(true);
+        struct xa_task *prev = xa_task_cur, *next = xa_runq.next;
+        xa_task_unlink(next);
+        xa_task_cur = next;
+        if (next != prev) {
+                xa_stats.switches++;
+                xa_trace_instant("switch");
+                // Has to be the last thing we do in case the task
+                // we're switching into is a new thread.
+                xa_task_switch(prev, next);
+                xa_task_reap();
+        }
+}
+
+static void
+freeze_stack_size(void)
+{
+        if (xa_task_stack_size < XA_TASK_STACK_MIN)
+                panic("xa_task_stack_size is below XA_TASK_STACK_MIN");
+        task_stack_size = xa_task_stack_size;
+}
+
+void
+xa_init(xcb_connection_t *c)
+{
+        pthread_once(&task_stack_once, freeze_stack_size);
+        if (xa_task_stack_size != task_stack_size)
+                panic("xa_task_stack_size changed after xa_init");
+        conn = c;
+        xa_task_setup();
+}
+
+// Spawn a task running func(arg) in group g.  If env is non-NULL,
+// arg is instead a copy of env placed at the top of the task's stack.
+static void
+xa_spawn_task(struct xa_group *g, void (*func)(void *), void *arg,
+              const void *env, size_t size)
+{
+        xa_task_setup();
+
+        // Allocate a task
+        struct xa_task *task = xa_task_alloc();
+        char *top = task->stack_top;
+        if (env) {
+                if (size > task_stack_size / 4)
+                        panic("xa_spawn_copy: environment too large");
+                top -= (size + 15) & ~(size_t)15;
+                memcpy(top, env, size);
+                arg = top;
+        }
+        xa_task_init_ctx(task, top);
+        task->start = func;
+        task->arg = arg;
+        task->id = ++xa_task_ids;
+        task->group = g;
+        if (g)
+                g->pending++;
+        xa_ntasks++;
+
+        // Execute the child up to its first wait (or exit).  This is
+        // good for efficiency, but also important to make the
+        // children send their initial requests in order.  Putting
+        // this task at the front of the run queue means we resume
+        // right after the child (and anything it spawns) blocks.
+        struct xa_task *self = xa_task_cur;
+        xa_task_insert(&xa_runq, self);
+        xa_task_cur = task;
+        xa_stats.switches++;
+        xa_trace_instant("spawn");
+        xa_task_switch(self, task);
+        xa_task_reap();
+}
+
+void
+xa_spawn_group(struct xa_group *g, void (*func)(void *), void *arg)
+{
+        xa_spawn_task(g, func, arg, NULL, 0);
+}
+
+void
+xa_spawn(void (*func)(void *), void *arg)
+{
+        xa_spawn_task(NULL, func, arg, NULL, 0);
+}
+
+void
+xa_spawn_copy(struct xa_group *g, void (*func)(void *), const void *env,
+              size_t size)
+{
+        xa_spawn_task(g, func, NULL, env, size);
+}
+
+// Block the current task until every task in g has exited.
+void
+xa_join(struct xa_group *g)
+{
+        if (g->pending == 0)
+                return;
+        if (g->joiner)
+                panic("xa_join: group already has a joiner");
+        g->joiner = xa_task_cur;
+        xa_schedule();
+}
+
+// Yield to other runnable tasks.
+void
+xa_wait(void)
+{
+        if (!xa_task_cur)
+                return;
+        xa_task_enqueue(&xa_runq, xa_task_cur);
+        xa_schedule();
+}
+
+// Block the current task until the reply to request sequence is
+// available and return it, as the corresponding xcb_*_reply function
+// would.  Other tasks run in the meantime.
+void *
+xa_await(unsigned int sequence, xcb_generic_error_t **e)
+{
+        xa_task_setup();
+        struct xa_task *self = xa_task_cur;
+        xa_stats.requests++;
+
+        // Insert in sequence order.  Tasks mostly wait in the order
+        // they issued requests, so this rarely walks far.
+        struct xa_task *pos = xa_waitq.prev;
+        while (pos != &xa_waitq && xa_seq_before(sequence, pos->wait_seq))
+                pos = pos->prev;
+        self->wait_seq = sequence;
+        xa_task_insert(pos, self);
+        xa_schedule();
+        xa_trace_complete(sequence);
+
+        void *reply = self->reply;
+        if (e)
+                *e = self->error;
+        else
+                free(self->error);
+        self->reply = NULL;
+        self->error = NULL;
+        return reply;
+}
+
+// Throw away the reply to request sequence.
+void
+xa_discard(unsigned int sequence)
+{
+        xa_stats.requests++;
+        xa_trace_complete(sequence);
+        xcb_discard_reply(conn, sequence);
+}
+
+// Block the main task until all other tasks have exited.
+void
+xa_drain(void)
+{
+        if (!xa_task_cur || xa_ntasks == 0)
+                return;
+        if (xa_task_cur != &xa_task_main)
+                panic("xa_drain called from a spawned task");
+        xa_task_drainer = xa_task_cur;
+        xa_schedule();
+}
+
+//////////////////////////////////////////////////////////////////
+// Arenas
+//
+
+#define ARENA_CHUNK (64*1024)
+
+struct xa_arena_chunk
+{
+        struct xa_arena_chunk *next;
+        char data[];
+};
+
+void *
+xa_arena_alloc(struct xa_arena *a, size_t size)
+{
+        size = (size + 15) & ~(size_t)15;
+        if ((size_t)(a->end - a->next) < size) {
+                size_t csize = size > ARENA_CHUNK ? size : ARENA_CHUNK;
+                struct xa_arena_chunk *c = malloc(sizeof *c + csize);
+                if (!c)
+                        panic("failed to malloc arena chunk");
+                c->next = a->chunks;
+                a->chunks = c;
+                a->next = c->data;
+                a->end = c->data + csize;
+        }
+        void *p = a->next;
+        a->next += size;
+        return p;
+}
+
+// Make the arena responsible for freeing p.  Returns p.
+void *
+xa_arena_own(struct xa_arena *a, void *p)
+{
+        if (!p)
+                return NULL;
+        if (a->nowned == a->owned_cap) {
+                a->owned_cap = a->owned_cap ? 2 * a->owned_cap : 256;
+                a->owned = realloc(a->owned, a->owned_cap * sizeof *a->owned);
+                if (!a->owned)
+                        panic("failed to realloc arena");
+        }
+        a->owned[a->nowned++] = p;
+        return p;
+}
+
+void
+xa_arena_release(struct xa_arena *a)
+{
+        for (size_t i = 0; i < a->nowned; ++i)
+                free(a->owned[i]);
+        a->nowned = 0;
+        while (a->chunks) {
+                struct xa_arena_chunk *c = a->chunks;
+                a->chunks = c->next;
+                free(c);
+        }
+        a->next = a->end = NULL;
+}
+
+//////////////////////////////////////////////////////////////////
+// Properties
+//
+
+bool
+xa_has_property(xcb_window_t win, xcb_atom_t atom)
+{
+        xcb_get_property_cookie_t gp =
+                xcb_get_property(conn, false, win, atom,
+                                 XCB_GET_PROPERTY_TYPE_ANY, 0, 0);
+        XA_TRACE_REQ("has_property", gp);
+        xcb_get_property_reply_t *gpr = xa_await(gp.sequence, NULL);
+        bool res = gpr && gpr->type != 0;
+        free(gpr);
+        return res;
+}
+
+// Start fetching up to max bytes of a property.
+xcb_get_property_cookie_t
+xa_get_property_start(xcb_window_t win, xcb_atom_t atom, xcb_atom_t type,
+                      int max)
+{
+        xcb_get_property_cookie_t gp =
+                xcb_get_property(conn, false, win, atom, type, 0, (max + 3) / 4);
+        XA_TRACE_REQ("get_property", gp);
+        return gp;
+}
+
+// Finish an xa_get_property_start.  If the property has the given type
+// and format, copy its value into out (or a new buffer if out is
+// NULL) and return it.  Otherwise, including if the window is gone,
+// return NULL.
+void *
+xa_get_property_finish(xcb_get_property_cookie_t gp, xcb_atom_t type, int format, void *out, int max)
+{
+        xcb_get_property_reply_t *gpr = xa_await(gp.sequence, NULL);
+        void *res = NULL;
+        if (gpr && gpr->type == type && gpr->format == format) {
+                int len = xcb_get_property_value_length(gpr);
+                if (len > max)
+                        len = max;
+                if (out)
+                        res = out;
+                else
+                        res = malloc(len);
+                if (!res) {
+                        perror("malloc");
+                        abort();
+                }
+                memmove(res, xcb_get_property_value(gpr), len);
+        }
+        free(gpr);
+        return res;
+}
+
+// Finish an xa_get_property_start without copying.  If the property has
+// the given type and format, point *value at it in the reply, which
+// a owns, and return its length in bytes.  Otherwise return -1.
+int
+xa_get_property_borrow(struct xa_arena *a, xcb_get_property_cookie_t gp, xcb_atom_t type, int format, const void **value)
+{
+        xcb_get_property_reply_t *gpr = xa_arena_own(a, xa_await(gp.sequence, NULL));
+        if (!gpr || gpr->type != type || gpr->format != format)
+                return -1;
+        *value = xcb_get_property_value(gpr);
+        return xcb_get_property_value_length(gpr);
+}
+
+void *
+xa_get_property(xcb_window_t win, xcb_atom_t atom, xcb_atom_t type, int format, void *out, int max)
+{
+        xcb_get_property_cookie_t gp =
+                xa_get_property_start(win, atom, type, max);
+        return xa_get_property_finish(gp, type, format, out, max);
+}
+
+uint32_t
+xa_card32_property(xcb_window_t win, xcb_atom_t atom)
+{
+        uint32_t res = 0;
+        xa_get_property(win, atom, XCB_ATOM_CARDINAL, 32, &res, sizeof(res));
+        return res;
+}
+
+xcb_atom_t
+xa_atom_property(xcb_window_t win, xcb_atom_t atom)
+{
+        xcb_atom_t res = 0;
+        xa_get_property(win, atom, XCB_ATOM_ATOM, 32, &res, sizeof(res));
+        return res;
+}
@@ -0,0 +1,153 @@
+// libxcbasync: hide X round-trip latency behind cooperative tasks.
+//
+// Each task runs on its own stack and blocks only in xa_await, so a
+// program can issue requests from many tasks and pay for one round
+// trip where a straight-line program would pay for one per request.
+// Everything here is per-thread: each thread that talks to a server
+// calls xa_init with its own connection and then drives its
+// own tasks.
+//
+// Spawning takes a plain function and argument, so nothing depends on
+// GCC nested functions or an executable stack.  xa_spawn_copy copies
+// a small environment onto the new task's stack, so callers can spawn
+// in a loop without keeping each argument alive themselves.
+
+#ifndef XCBASYNC_H
+#define XCBASYNC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <xcb/xcb.h>
+
+//////////////////////////////////////////////////////////////////
+// Tracing
+//
+
+// Start recording a trace, to be written to path at exit.  Does
+// nothing if path is NULL or empty.
+void xa_trace_init(const char *path);
+
+// Set the process ID this thread's events appear under.  Give each
+// connection its own.
+void xa_trace_set_pid(int pid);
+
+// The trace clock, in nanoseconds.  This works even when tracing is
+// off.
+uint64_t xa_trace_now(void);
+
+void xa_trace_issue(const char *name, unsigned int seq);
+void xa_trace_complete(unsigned int seq);
+void xa_trace_span(const char *name, uint64_t start);
+void xa_trace_instant(const char *name);
+
+// Record that the request for cookie was just issued.
+#define XA_TRACE_REQ(name, cookie) xa_trace_issue(name, (cookie).sequence)
+
+//////////////////////////////////////////////////////////////////
+// Tasks
+//
+
+// The size of each task's stack, which must be at least
+// XA_TASK_STACK_MIN.  Stack pools are per-thread, so the first call
+// to xa_init checks this and fixes it for every thread; later calls
+// panic if it has changed.
+extern size_t xa_task_stack_size;
+
+// Room for the canary, the initial frame and a little real work
+#define XA_TASK_STACK_MIN (4*1024)
+
+// Requests counts requests whose replies were awaited or discarded,
+// plus checked requests.  Round trips counts the times the scheduler
+// had to block on the server.  Tasks and slabs count stack
+// allocations, and alloc_ns is the time spent making them.
+struct xa_stats
+{
+        unsigned long requests, switches, round_trips;
+        unsigned long tasks, slabs;
+        uint64_t alloc_ns;
+};
+
+extern __thread struct xa_stats xa_stats;
+
+struct xa_task;
+
+// A task group is a set of tasks spawned by one parent, which can
+// wait for exactly those tasks with xa_join.  Tasks return results
+// through their arg, which the parent owns and reduces after the
+// join.  Zero-initialize before use.
+struct xa_group
+{
+        // Tasks in the group that haven't exited
+        int pending;
+        // The task blocked in xa_join, if any
+        struct xa_task *joiner;
+};
+
+// Use c for this thread's tasks.
+void xa_init(xcb_connection_t *c);
+
+// Spawn a task running func(arg) in group g, which may be NULL.  The
+// task runs until it first blocks before this returns.
+void xa_spawn_group(struct xa_group *g, void (*func)(void *), void *arg);
+void xa_spawn(void (*func)(void *), void *arg);
+
+// Like xa_spawn_group, but copy size bytes at env onto the task's
+// stack and pass func the copy, which lives as long as the task.
+void xa_spawn_copy(struct xa_group *g, void (*func)(void *),
+                   const void *env, size_t size);
+
+// Spawn func on a copy of the lvalue env.
+#define XA_SPAWN_COPY(g, func, env) \
+        xa_spawn_copy(g, func, &(env), sizeof(env))
+
+void xa_join(struct xa_group *g);
+void xa_wait(void);
+void *xa_await(unsigned int sequence, xcb_generic_error_t **e);
+void xa_discard(unsigned int sequence);
+void xa_drain(void);
+
+//////////////////////////////////////////////////////////////////
+// Arenas
+//
+// An arena owns memory for one lookup: scratch allocations, which are
+// bump-allocated from large chunks, and X replies, which libxcb
+// mallocs.  Everything is released together by xa_arena_release, so
+// values can be borrowed straight out of replies instead of being
+// copied, and nobody has to track when the last user of a reply is
+// done with it.  Zero-initialize before use.
+
+struct xa_arena_chunk;
+
+struct xa_arena
+{
+        struct xa_arena_chunk *chunks;
+        char *next, *end;
+        void **owned;
+        size_t nowned, owned_cap;
+};
+
+void *xa_arena_alloc(struct xa_arena *a, size_t size);
+void *xa_arena_own(struct xa_arena *a, void *p);
+void xa_arena_release(struct xa_arena *a);
+
+//////////////////////////////////////////////////////////////////
+// Properties
+//
+// These all block the calling task, not the thread.
+
+bool xa_has_property(xcb_window_t win, xcb_atom_t atom);
+xcb_get_property_cookie_t xa_get_property_start(xcb_window_t win,
+                                                xcb_atom_t atom,
+                                                xcb_atom_t type, int max);
+void *xa_get_property_finish(xcb_get_property_cookie_t gp, xcb_atom_t type,
+                             int format, void *out, int max);
+int xa_get_property_borrow(struct xa_arena *a, xcb_get_property_cookie_t gp,
+                           xcb_atom_t type, int format, const void **value);
+void *xa_get_property(xcb_window_t win, xcb_atom_t atom, xcb_atom_t type,
+                      int format, void *out, int max);
+uint32_t xa_card32_property(xcb_window_t win, xcb_atom_t atom);
+xcb_atom_t xa_atom_property(xcb_window_t win, xcb_atom_t atom);
+
+#endif
@@ -0,0 +1,226 @@
+// Stress test against a real X server; see stress.sh.
+//
+// This builds a tree of fanout^depth leaf windows, some of which are
+// WM_STATE clients, on a connection of its own.  Then each thread
+// opens its own connection and walks the entire window tree with one
+// task per window, so thousands of tasks are alive and waiting at
+// once.  Every thread must count the windows and clients the tree was
+// built with.
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "xcbasync.h"
+
+static int depth = 4, fanout = 8, walks = 3;
+static long want_windows, want_clients = 1000;
+
+struct walk
+{
+        xcb_window_t win;
+        long windows, clients;
+        int depth;
+};
+
+static __thread xcb_connection_t *conn;
+static __thread xcb_atom_t wm_state;
+
+static xcb_atom_t
+intern_wm_state(xcb_connection_t *c)
+{
+        xcb_intern_atom_reply_t *iar = xcb_intern_atom_reply(
+                c, xcb_intern_atom(c, false, 8, "WM_STATE"), NULL);
+        if (!iar)
+                return XCB_NONE;
+        xcb_atom_t atom = iar->atom;
+        free(iar);
+        return atom;
+}
+
+// Create the subtree under parent.  leaf counts the leaves created
+// so far, which decides which of them become clients.
+static void
+make_tree(xcb_connection_t *c, const xcb_screen_t *screen,
+          xcb_window_t parent, int level, long nleaves, long *leaf)
+{
+        for (int i = 0; i < fanout; ++i) {
+                xcb_window_t win = xcb_generate_id(c);
+                xcb_create_window(c, XCB_COPY_FROM_PARENT, win, parent,
+                                  0, 0, 1, 1, 0,
+                                  XCB_WINDOW_CLASS_INPUT_OUTPUT,
+                                  screen->root_visual, 0, NULL);
+                if (level + 1 < depth) {
+                        make_tree(c, screen, win, level + 1, nleaves, leaf);
+                        continue;
+                }
+                // Spread the clients evenly over the leaves.
+                long k = (*leaf)++;
+                if (k * want_clients / nleaves !=
+                    (k + 1) * want_clients / nleaves) {
+                        uint32_t state[] = {1, 0};
+                        xcb_change_property(c, XCB_PROP_MODE_REPLACE, win,
+                                            wm_state, wm_state, 32, 2,
+                                            state);
+                }
+        }
+}
+
+// Build the tree on a connection of its own, which must stay open
+// for the windows to live.
+static xcb_connection_t *
+build_tree(void)
+{
+        xcb_connection_t *c = xcb_connect(NULL, NULL);
+        if (xcb_connection_has_error(c)) {
+                fprintf(stderr, "error opening display\n");
+                exit(1);
+        }
+        const xcb_screen_t *screen =
+                xcb_setup_roots_iterator(xcb_get_setup(c)).data;
+        if (!(wm_state = intern_wm_state(c))) {
+                fprintf(stderr, "InternAtom failed\n");
+                exit(1);
+        }
+        long nleaves = 1;
+        for (int i = 0; i < depth; ++i) {
+                nleaves *= fanout;
+                want_windows += nleaves;
+        }
+        if (want_clients > nleaves) {
+                fprintf(stderr, "need clients <= fanout^depth (%ld)\n",
+                        nleaves);
+                exit(2);
+        }
+        long leaf = 0;
+        make_tree(c, screen, screen->root, 0, nleaves, &leaf);
+        // Wait for the server to create everything.
+        free(xcb_get_input_focus_reply(c, xcb_get_input_focus(c), NULL));
+        printf("%ld windows %ld clients\n", want_windows, want_clients);
+        return c;
+}
+
+static void
+walk_task(void *arg)
+{
+        struct walk *w = arg;
+        // Send both requests before waiting on either.
+        xcb_get_property_cookie_t gp =
+                xcb_get_property(conn, false, w->win, wm_state,
+                                 XCB_GET_PROPERTY_TYPE_ANY, 0, 0);
+        xcb_query_tree_cookie_t qt = xcb_query_tree(conn, w->win);
+        xcb_get_property_reply_t *gpr = xa_await(gp.sequence, NULL);
+        xcb_query_tree_reply_t *qtr = xa_await(qt.sequence, NULL);
+        w->windows = 1;
+        w->clients = gpr && gpr->type != 0;
+        free(gpr);
+        if (!qtr)
+                return;
+
+        int n = xcb_query_tree_children_length(qtr);
+        xcb_window_t *kids = xcb_query_tree_children(qtr);
+        struct walk *sub = malloc(n * sizeof *sub);
+        struct xa_group g = {};
+        for (int i = 0; i < n; ++i) {
+                sub[i] = (struct walk){.win = kids[i],
+                                       .depth = w->depth + 1};
+                xa_spawn_group(&g, walk_task, &sub[i]);
+        }
+        xa_join(&g);
+        for (int i = 0; i < n; ++i) {
+                w->windows += sub[i].windows;
+                w->clients += sub[i].clients;
+                if (sub[i].depth > w->depth)
+                        w->depth = sub[i].depth;
+        }
+        free(sub);
+        free(qtr);
+}
+
+static void *
+thread_main(void *arg)
+{
+        long id = (long)arg;
+        xcb_connection_t *c = conn = xcb_connect(NULL, NULL);
+        if (xcb_connection_has_error(c)) {
+                fprintf(stderr, "thread %ld: error opening display\n", id);
+                return (void*)1;
+        }
+        xa_init(c);
+        if (!(wm_state = intern_wm_state(c))) {
+                fprintf(stderr, "thread %ld: InternAtom failed\n", id);
+                return (void*)1;
+        }
+
+        xcb_window_t root =
+                xcb_setup_roots_iterator(xcb_get_setup(c)).data->root;
+        long bad = 0;
+        for (int i = 0; i < walks; ++i) {
+                memset(&xa_stats, 0, sizeof xa_stats);
+                struct walk w = {.win = root};
+                struct xa_group g = {};
+                xa_spawn_group(&g, walk_task, &w);
+                xa_join(&g);
+                printf("thread %ld walk %d: %ld windows %ld clients "
+                       "depth %d, %lu tasks from %lu slabs, "
+                       "%lu round trips\n", id, i, w.windows - 1, w.clients,
+                       w.depth, xa_stats.tasks, xa_stats.slabs,
+                       xa_stats.round_trips);
+                if (w.windows - 1 != want_windows ||
+                    w.clients != want_clients) {
+                        fprintf(stderr, "thread %ld walk %d: want %ld windows "
+                                "%ld clients\n", id, i, want_windows,
+                                want_clients);
+                        bad++;
+                }
+        }
+        xcb_disconnect(c);
+        return (void*)bad;
+}
+
+int
+main(int argc, char **argv)
+{
+        int threads = 4;
+        int opt;
+        while ((opt = getopt(argc, argv, "d:f:c:t:n:")) != -1) {
+                switch (opt) {
+                case 'd': depth = atoi(optarg); break;
+                case 'f': fanout = atoi(optarg); break;
+                case 'c': want_clients = atol(optarg); break;
+                case 't': threads = atoi(optarg); break;
+                case 'n': walks = atoi(optarg); break;
+                default:
+                        fprintf(stderr, "usage: %s [-d depth] [-f fanout] "
+                                "[-c clients] [-t threads] [-n walks]\n",
+                                argv[0]);
+                        return 2;
+                }
+        }
+        if (depth < 1 || fanout < 1 || want_clients < 0) {
+                fprintf(stderr, "need depth, fanout >= 1, clients >= 0\n");
+                return 2;
+        }
+        xcb_connection_t *tree = build_tree();
+
+        pthread_t *tids = malloc(threads * sizeof *tids);
+        if (!tids)
+                return 1;
+        for (long i = 0; i < threads; ++i) {
+                if (pthread_create(&tids[i], NULL, thread_main, (void*)i)) {
+                        fprintf(stderr, "pthread_create failed\n");
+                        return 1;
+                }
+        }
+        long bad = 0;
+        for (int i = 0; i < threads; ++i) {
+                void *res;
+                pthread_join(tids[i], &res);
+                bad += (long)res;
+        }
+        free(tids);
+        xcb_disconnect(tree);
+        return bad ? 1 : 0;
+}
@@ -0,0 +1,421 @@
+// Unit tests for the task scheduler.
+//
+// These link against a fake libxcb instead of a real server.  The
+// fake answers every request that has been flushed once the
+// scheduler polls its connection, so a test can count exactly how
+// many round trips a pattern of tasks costs.
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "xcbasync.h"
+
+//////////////////////////////////////////////////////////////////
+// Fake libxcb
+//
+
+static unsigned int issued, flushed, answered;
+static int server_pipe[2];
+static bool server_pending;
+static long discarded;
+static char fake_conn;
+
+// Issue a request that gets an empty reply.
+static unsigned int
+fake_request(void)
+{
+        return ++issued;
+}
+
+int
+xcb_flush(xcb_connection_t *c)
+{
+        (void)c;
+        if (flushed != issued && !server_pending) {
+                if (write(server_pipe[1], "x", 1) != 1) {
+                        perror("write");
+                        abort();
+                }
+                server_pending = true;
+        }
+        flushed = issued;
+        return 1;
+}
+
+int
+xcb_get_file_descriptor(xcb_connection_t *c)
+{
+        (void)c;
+        return server_pipe[0];
+}
+
+int
+xcb_connection_has_error(xcb_connection_t *c)
+{
+        (void)c;
+        return 0;
+}
+
+int
+xcb_poll_for_reply(xcb_connection_t *c, unsigned int request, void **reply,
+                   xcb_generic_error_t **error)
+{
+        (void)c;
+        // The server answers everything flushed so far in one go.
+        if (server_pending) {
+                char b;
+                if (read(server_pipe[0], &b, 1) != 1) {
+                        perror("read");
+                        abort();
+                }
+                server_pending = false;
+                answered = flushed;
+        }
+        if ((int)(request - answered) > 0)
+                return 0;
+        xcb_get_property_reply_t *r = calloc(1, sizeof *r);
+        if (!r)
+                abort();
+        r->response_type = XCB_GET_PROPERTY;
+        r->sequence = request;
+        *reply = r;
+        *error = NULL;
+        return 1;
+}
+
+void
+xcb_discard_reply(xcb_connection_t *c, unsigned int sequence)
+{
+        (void)c;
+        (void)sequence;
+        discarded++;
+}
+
+xcb_get_property_cookie_t
+xcb_get_property(xcb_connection_t *c, uint8_t _delete, xcb_window_t window,
+                 xcb_atom_t property, xcb_atom_t type, uint32_t long_offset,
+                 uint32_t long_length)
+{
+        (void)c, (void)_delete, (void)window, (void)property, (void)type;
+        (void)long_offset, (void)long_length;
+        return (xcb_get_property_cookie_t){fake_request()};
+}
+
+void *
+xcb_get_property_value(const xcb_get_property_reply_t *r)
+{
+        return (void*)(r + 1);
+}
+
+int
+xcb_get_property_value_length(const xcb_get_property_reply_t *r)
+{
+        (void)r;
+        return 0;
+}
+
+//////////////////////////////////////////////////////////////////
+// Tests
+//
+
+static int failures;
+
+#define CHECK(cond) do {                                                \
+                if (!(cond)) {                                          \
+                        fprintf(stderr, "%s:%d: %s: check failed: %s\n", \
+                                __FILE__, __LINE__, __func__, #cond);   \
+                        failures++;                                     \
+                }                                                       \
+        } while (0)
+
+// Await a fresh request and check that the reply is the right one.
+static void
+await_one(void)
+{
+        unsigned int seq = fake_request();
+        xcb_get_property_reply_t *r = xa_await(seq, NULL);
+        CHECK(r && r->sequence == (uint16_t)seq);
+        free(r);
+}
+
+static void
+reset_stats(void)
+{
+        memset(&xa_stats, 0, sizeof xa_stats);
+}
+
+// Tasks that each await a reply all share one round trip, and each
+// gets its own reply.
+static int await_done;
+
+static void
+await_task(void *arg)
+{
+        (void)arg;
+        await_one();
+        await_done++;
+}
+
+static void
+test_await(void)
+{
+        reset_stats();
+        await_done = 0;
+        for (int i = 0; i < 100; ++i)
+                xa_spawn(await_task, NULL);
+        CHECK(await_done == 0);
+        xa_drain();
+        CHECK(await_done == 100);
+        CHECK(xa_stats.round_trips == 1);
+        CHECK(xa_stats.requests == 100);
+}
+
+// A tree of tasks, each of which awaits a reply before spawning its
+// children, costs one round trip per level.
+struct node
+{
+        int depth;
+        long count;
+};
+
+#define TREE_DEPTH 4
+#define TREE_FANOUT 8
+
+static void
+tree_task(void *arg)
+{
+        struct node *n = arg;
+        await_one();
+        n->count = 1;
+        if (n->depth == TREE_DEPTH)
+                return;
+        struct node kids[TREE_FANOUT];
+        struct xa_group g = {};
+        for (int i = 0; i < TREE_FANOUT; ++i) {
+                kids[i] = (struct node){n->depth + 1, 0};
+                xa_spawn_group(&g, tree_task, &kids[i]);
+        }
+        xa_join(&g);
+        for (int i = 0; i < TREE_FANOUT; ++i)
+                n->count += kids[i].count;
+}
+
+static void
+test_tree(void)
+{
+        reset_stats();
+        struct node root = {0, 0};
+        struct xa_group g = {};
+        xa_spawn_group(&g, tree_task, &root);
+        xa_join(&g);
+        long want = 0;
+        for (long i = 0, n = 1; i <= TREE_DEPTH; ++i, n *= TREE_FANOUT)
+                want += n;
+        CHECK(root.count == want);
+        CHECK(xa_stats.tasks == (unsigned long)want);
+        CHECK(xa_stats.round_trips == TREE_DEPTH + 1);
+        // The leaves all exist at once, so the pool had to grow.
+        CHECK(xa_stats.slabs > 1);
+        CHECK(xa_stats.alloc_ns > 0);
+}
+
+// xa_join waits for exactly the tasks in its group.
+static int slow_steps;
+
+static void
+slow_task(void *arg)
+{
+        (void)arg;
+        for (int i = 0; i < 3; ++i) {
+                await_one();
+                slow_steps++;
+        }
+}
+
+static void
+join_child(void *arg)
+{
+        int *done = arg;
+        await_one();
+        (*done)++;
+}
+
+// Join a nested group from inside a task.
+static void
+join_parent(void *arg)
+{
+        int *done = arg;
+        int kids = 0;
+        struct xa_group g = {};
+        for (int i = 0; i < 4; ++i)
+                xa_spawn_group(&g, join_child, &kids);
+        xa_join(&g);
+        CHECK(kids == 4);
+        *done = kids;
+}
+
+static void
+test_join(void)
+{
+        // Joining an empty group returns without switching.
+        struct xa_group empty = {};
+        unsigned long switches = xa_stats.switches;
+        xa_join(&empty);
+        CHECK(xa_stats.switches == switches);
+
+        slow_steps = 0;
+        xa_spawn(slow_task, NULL);
+        int done = 0, nested = 0;
+        struct xa_group g = {};
+        xa_spawn_group(&g, join_child, &done);
+        xa_spawn_group(&g, join_parent, &nested);
+        xa_join(&g);
+        CHECK(done == 1);
+        CHECK(nested == 4);
+        CHECK(g.pending == 0);
+        // The task outside the group may still be running.
+        CHECK(slow_steps < 3);
+        xa_drain();
+        CHECK(slow_steps == 3);
+
+        // A group can be joined again once it's refilled.
+        xa_spawn_group(&g, join_child, &done);
+        xa_join(&g);
+        CHECK(done == 2);
+}
+
+// xa_spawn_copy gives each task its own copy of the environment,
+// which lives as long as the task.
+struct copy_env
+{
+        int i;
+        char pad[13];
+        long *sum;
+};
+
+static void
+copy_task(void *arg)
+{
+        struct copy_env *env = arg;
+        CHECK(((uintptr_t)env & 15) == 0);
+        int i = env->i;
+        await_one();
+        // The caller has overwritten its env by now.
+        CHECK(env->i == i);
+        for (size_t j = 0; j < sizeof env->pad; ++j)
+                CHECK(env->pad[j] == (char)(i + j));
+        *env->sum += env->i;
+}
+
+static void
+big_copy_task(void *arg)
+{
+        const unsigned char *buf = arg;
+        await_one();
+        for (size_t i = 0; i < xa_task_stack_size / 4; ++i)
+                CHECK(buf[i] == (unsigned char)i);
+}
+
+static void
+test_spawn_copy(void)
+{
+        long sum = 0;
+        struct xa_group g = {};
+        struct copy_env env = {.sum = &sum};
+        for (env.i = 1; env.i <= 100; ++env.i) {
+                for (size_t j = 0; j < sizeof env.pad; ++j)
+                        env.pad[j] = env.i + j;
+                XA_SPAWN_COPY(&g, copy_task, env);
+        }
+        xa_join(&g);
+        CHECK(sum == 100 * 101 / 2);
+
+        // The largest environment xa_spawn_copy accepts.
+        size_t size = xa_task_stack_size / 4;
+        unsigned char *buf = malloc(size);
+        for (size_t i = 0; i < size; ++i)
+                buf[i] = i;
+        xa_spawn_copy(&g, big_copy_task, buf, size);
+        memset(buf, 0, size);
+        xa_join(&g);
+        free(buf);
+}
+
+// Stacks go back to the pool when tasks exit.
+static void
+test_reuse(void)
+{
+        reset_stats();
+        for (int i = 0; i < 1000; ++i) {
+                xa_spawn(await_task, NULL);
+                xa_drain();
+        }
+        CHECK(xa_stats.tasks == 1000);
+        CHECK(xa_stats.slabs == 0);
+}
+
+// Discarded replies don't block anyone.
+static void
+test_discard(void)
+{
+        long before = discarded;
+        xa_discard(fake_request());
+        await_one();
+        CHECK(discarded == before + 1);
+}
+
+// Once xa_init has fixed the stack size, changing it is caught
+// before any thread pools stacks of the wrong size.
+static void
+test_stack_frozen(void)
+{
+        pid_t pid = fork();
+        if (pid == 0) {
+                int null = open("/dev/null", O_WRONLY);
+                if (null >= 0)
+                        dup2(null, 2);
+                xa_task_stack_size *= 2;
+                xa_init((xcb_connection_t*)&fake_conn);
+                _exit(0);
+        }
+        int status;
+        CHECK(pid > 0 && waitpid(pid, &status, 0) == pid);
+        CHECK(WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT);
+}
+
+int
+main(void)
+{
+        if (pipe(server_pipe) < 0) {
+                perror("pipe");
+                return 1;
+        }
+        xa_init((xcb_connection_t*)&fake_conn);
+
+        struct {
+                const char *name;
+                void (*fn)(void);
+        } tests[] = {
+                {"await", test_await},
+                {"tree", test_tree},
+                {"join", test_join},
+                {"spawn_copy", test_spawn_copy},
+                {"reuse", test_reuse},
+                {"discard", test_discard},
+                {"stack_frozen", test_stack_frozen},
+        };
+        for (size_t i = 0; i < sizeof tests / sizeof *tests; ++i) {
+                int before = failures;
+                tests[i].fn();
+                printf("%s %s\n", failures == before ? "ok  " : "FAIL",
+                       tests[i].name);
+        }
+        return failures ? 1 : 0;
+}